@@ -0,0 +1,295 @@
+#include <iostream>
+#include <format>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "zulu_cow.hpp"
+
+// Replays I/O traces (arrays of CowTraceRecord, as recorded with ImageBackingStore::setTraceHook)
+// against each combination of bitmap and buffer sizes, and reports throughput and I/O amplification
+// Requests are replayed back to back, timestamps are kept for tools that study think time
+// Without trace files a synthetic boot, compile and format workload is used
+// Build it as cow_bench_instr (make cow_bench_instr) for file call counts and latencies
+// -f replays through the store specialized for the block size (BasicImageBackingStore<512> or <2048>), traces
+// then count LBAs in blocks of that size, comparing the timing with a run without -f shows the cycles it saves
+
+static void usage()
+{
+    std::cout << "Usage: cow_bench [-b bitmap_sizes] [-B buffer_sizes] [-f block_size] [-i image] [-o overlay] [-W write_back_size]\n"
+                 "                 [-w synthetic.trace] [trace ...]\n"
+                 "  -b, -B  comma separated sizes in bytes (default 256,1024,4096 and 512,2048,8192)\n"
+                 "  -f      replay on the store fixed to this block size, 512 or 2048 (default: 512, not fixed)\n"
+                 "  -i, -o  original and overlay files (default: in-memory images of the mock backend)\n"
+                 "  -W      write-back buffer size in bytes (default 0, disabled)\n"
+                 "  -w      write the synthetic trace to a file and exit\n";
+    exit(1);
+}
+
+static std::vector<uint32_t> parseSizes(const char *list)
+{
+    std::vector<uint32_t> sizes;
+    for (const char *p = list; *p != '\0';)
+    {
+        char *end;
+        sizes.push_back(static_cast<uint32_t>(strtoul(p, &end, 0)));
+        if (end == p || sizes.back() == 0)
+        {
+            usage();
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return sizes;
+}
+
+static bool loadTrace(const char *filename, std::vector<CowTraceRecord> &trace)
+{
+    std::ifstream file(filename, std::ios::binary);
+    CowTraceRecord record;
+    while (file.read(reinterpret_cast<char *>(&record), sizeof(record)))
+    {
+        trace.push_back(record);
+    }
+    return file.eof() && file.gcount() == 0; // Fails on a missing file or a truncated record
+}
+
+// Boot (large sequential reads), compile (small scattered reads and writes) and format (large
+// sequential writes) phases over the first image_blocks blocks of block_size bytes
+static std::vector<CowTraceRecord> syntheticTrace(uint32_t image_blocks, uint32_t block_size)
+{
+    std::vector<CowTraceRecord> trace;
+    std::mt19937 gen(1);
+    uint64_t now = 0;
+    auto add = [&](CowTraceOp op, uint32_t lba, uint32_t blocks) {
+        blocks = std::min(blocks, image_blocks - lba);
+        trace.push_back({now += 100, lba, blocks * block_size, op, 0});
+    };
+
+    for (uint32_t lba = 0; lba < image_blocks / 4; lba += 128)
+    {
+        add(CowTraceOp::Read, lba, 128);
+    }
+    std::uniform_int_distribution<uint32_t> lba_dis(0, image_blocks - 1);
+    std::uniform_int_distribution<uint32_t> size_dis(1, 16);
+    for (int i = 0; i < 20000; i++)
+    {
+        add(i % 3 == 0 ? CowTraceOp::Write : CowTraceOp::Read, lba_dis(gen), size_dis(gen));
+    }
+    for (uint32_t lba = image_blocks / 2; lba < image_blocks; lba += 256)
+    {
+        add(CowTraceOp::Write, lba, 256);
+    }
+    return trace;
+}
+
+#if ZULU_COW_INSTRUMENTATION
+// Upper bound in microseconds of the latency bucket reached by 'fraction' of the requests
+static uint64_t percentile(const std::array<uint64_t, CowInstrumentation::kLatencyBuckets> &histogram, double fraction)
+{
+    uint64_t total = 0;
+    for (uint64_t count : histogram)
+    {
+        total += count;
+    }
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < histogram.size(); i++)
+    {
+        seen += histogram[i];
+        if (seen > 0 && seen >= fraction * total)
+        {
+            return (uint64_t{1} << i) - 1;
+        }
+    }
+    return 0;
+}
+
+// Average of a file call count histogram
+static double averageCalls(const std::array<uint64_t, CowInstrumentation::kCallBuckets> &histogram)
+{
+    uint64_t requests = 0;
+    uint64_t calls = 0;
+    for (uint32_t i = 0; i < histogram.size(); i++)
+    {
+        requests += histogram[i];
+        calls += i * histogram[i];
+    }
+    return requests > 0 ? static_cast<double>(calls) / requests : 0;
+}
+#endif
+
+// Replays 'trace' on a fresh Store, returns false if a request fails
+template <typename Store>
+static bool replay(const std::vector<CowTraceRecord> &trace, const char *image, const char *overlay,
+                   const ImageBackingStoreOptions &options, bool fixed)
+{
+    Store bs(image, overlay, options);
+    uint64_t image_size = bs.getOriginalFile().size();
+
+    uint32_t max_count = 0;
+    for (const CowTraceRecord &record : trace)
+    {
+        max_count = std::max(max_count, record.count);
+    }
+    std::vector<uint8_t> buffer(max_count);
+    for (size_t i = 0; i < buffer.size(); i++)
+    {
+        buffer[i] = static_cast<uint8_t>(i / 512 + 1); // Not zeros, zero groups would skew writes
+    }
+
+    size_t requests = 0;
+    size_t skipped = 0;
+    uint64_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const CowTraceRecord &record : trace)
+    {
+        uint64_t from = static_cast<uint64_t>(record.lba) * options.scsi_block_size;
+        if (record.count == 0 || from + record.count > image_size)
+        {
+            skipped++; // Recorded on a larger image
+            continue;
+        }
+
+        bs.set_position(from);
+        ssize_t result;
+        switch (record.op)
+        {
+        case CowTraceOp::Read:
+            result = bs.cow_read(buffer.data(), record.count);
+            break;
+        case CowTraceOp::Write:
+            result = bs.cow_write(buffer.data(), record.count);
+            break;
+        case CowTraceOp::Unmap:
+            result = bs.cow_unmap(record.count);
+            break;
+        default:
+            skipped++;
+            continue;
+        }
+        if (result != static_cast<ssize_t>(record.count))
+        {
+            std::cout << std::format("Request {} (op {}, lba {}, {} bytes) failed: {}\n", requests, static_cast<uint32_t>(record.op),
+                                     record.lba, record.count, result);
+            return false;
+        }
+        requests++;
+        bytes += record.count;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::format("bitmap {:6} buffer {:6}{}: {} requests ({} skipped), {:.3f} s, {:.1f} MB/s, {:.0f} requests/s\n",
+                             options.bitmap_size, options.buffer_size, fixed ? " fixed" : "", requests, skipped, seconds,
+                             bytes / 1048576.0 / seconds, requests / seconds);
+    std::cout << std::format("  {}\n", bs.stats());
+#if ZULU_COW_INSTRUMENTATION
+    const CowInstrumentation &counters = bs.instrumentation();
+    std::cout << std::format("  File reads/writes/seeks: {}/{}/{}, calls per read/write: {:.2f}/{:.2f}\n", counters.file_reads,
+                             counters.file_writes, counters.file_seeks, averageCalls(counters.read_calls), averageCalls(counters.write_calls));
+    std::cout << std::format("  p50/p99 us, read: {}/{}, write: {}/{}, copy-on-write: {}/{}\n", percentile(counters.read_latency, 0.5),
+                             percentile(counters.read_latency, 0.99), percentile(counters.write_latency, 0.5),
+                             percentile(counters.write_latency, 0.99), percentile(counters.copy_latency, 0.5),
+                             percentile(counters.copy_latency, 0.99));
+#else
+    std::cout << "  File reads/writes/seeks and latencies: see cow_bench_instr\n";
+#endif
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint32_t> bitmap_sizes = {256, 1024, 4096};
+    std::vector<uint32_t> buffer_sizes = {512, 2048, 8192};
+    const char *image = "";
+    const char *overlay = "";
+    const char *synthetic_output = nullptr;
+    uint32_t write_back_size = 0;
+    uint32_t fixed_block_size = 0;
+    std::vector<CowTraceRecord> trace;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (arg[0] == '-' && (strlen(arg) != 2 || i + 1 >= argc))
+        {
+            usage();
+        }
+        if (strcmp(arg, "-b") == 0)
+        {
+            bitmap_sizes = parseSizes(argv[++i]);
+        }
+        else if (strcmp(arg, "-B") == 0)
+        {
+            buffer_sizes = parseSizes(argv[++i]);
+        }
+        else if (strcmp(arg, "-f") == 0)
+        {
+            fixed_block_size = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 0));
+            if (fixed_block_size != 512 && fixed_block_size != 2048)
+            {
+                usage();
+            }
+        }
+        else if (strcmp(arg, "-i") == 0)
+        {
+            image = argv[++i];
+        }
+        else if (strcmp(arg, "-o") == 0)
+        {
+            overlay = argv[++i];
+        }
+        else if (strcmp(arg, "-W") == 0)
+        {
+            write_back_size = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 0));
+        }
+        else if (strcmp(arg, "-w") == 0)
+        {
+            synthetic_output = argv[++i];
+        }
+        else if (arg[0] == '-')
+        {
+            usage();
+        }
+        else if (!loadTrace(arg, trace))
+        {
+            std::cout << std::format("Cannot read trace {}\n", arg);
+            return 1;
+        }
+    }
+
+    uint32_t block_size = fixed_block_size != 0 ? fixed_block_size : 512;
+    if (trace.empty())
+    {
+        ImageBackingStore bs(image, overlay, ImageBackingStoreOptions{});
+        trace = syntheticTrace(static_cast<uint32_t>(bs.getOriginalFile().size() / block_size), block_size);
+    }
+    if (synthetic_output != nullptr)
+    {
+        std::ofstream file(synthetic_output, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(trace.data()), trace.size() * sizeof(CowTraceRecord));
+        return file ? 0 : 1;
+    }
+
+    for (uint32_t bitmap_size : bitmap_sizes)
+    {
+        for (uint32_t buffer_size : buffer_sizes)
+        {
+            ImageBackingStoreOptions options;
+            options.bitmap_size = bitmap_size;
+            options.buffer_size = buffer_size;
+            options.write_back_size = write_back_size;
+            options.scsi_block_size = block_size;
+            bool replayed = fixed_block_size == 512    ? replay<BasicImageBackingStore<512>>(trace, image, overlay, options, true)
+                            : fixed_block_size == 2048 ? replay<BasicImageBackingStore<2048>>(trace, image, overlay, options, true)
+                                                       : replay<ImageBackingStore>(trace, image, overlay, options, false);
+            if (!replayed)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
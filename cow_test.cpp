@@ -4,11 +4,18 @@
 #include <cstdint>
 #include <random>
 #include <iomanip>
+#include <sstream>
+#include <cstring>
 #include "fsfile_mock.h"
 
 // Include the implementation
 #include "zulu_cow.hpp"
 
+#if ZULU_COW_CONCURRENT
+#include <atomic>
+#include <thread>
+#endif
+
 FsFile fs;
 
 std::mt19937 gen(1);
@@ -108,7 +115,8 @@ void diff(const std::vector<uint8_t> &data1, const std::vector<uint8_t> &data2)
 }
 
 /* Compare the contents of fs and bs */
-void check_integrity(ImageBackingStore &bs)
+template <typename Store>
+void check_integrity(Store &bs)
 {
     if (fs.data() == bs.recreate())
         return;
@@ -134,6 +142,13 @@ uint32_t rand_sector()
     return rand_int(1, max_sectors);
 }
 
+// Creates a named mock file of the default size, as originals are opened without O_CREAT
+void create_image(const char *name)
+{
+    FsFile file;
+    file.open(name, O_RDWR | O_CREAT);
+}
+
 // Function to fill a vector with pseudo random uint8_t values using C++ random
 void fillWithPseudoRandom(std::vector<uint8_t> &vec)
 {
@@ -157,12 +172,10 @@ std::tuple<u_int32_t, u_int32_t> rand_start_and_size()
     return {start_sector * 512, num_sectors * 512};
 }
 
-void one_write(ImageBackingStore &bs)
+// Writes the same random data to fs and bs
+template <typename Store>
+void write_at(Store &bs, uint32_t start_byte, uint32_t size)
 {
-    auto [start_byte, size] = rand_start_and_size();
-
-    std::cout << std::format("Write at {} size {} ", start_byte, size);
-
     std::vector<uint8_t> buffer(size);
     fillWithPseudoRandom(buffer);
     // Write to both fs and bs
@@ -172,12 +185,10 @@ void one_write(ImageBackingStore &bs)
     bs.cow_write(buffer.data(), size);
 }
 
-void one_read(ImageBackingStore &bs)
+// Reads from fs and bs, exits if they differ
+template <typename Store>
+void read_at(Store &bs, uint32_t start_byte, uint32_t size)
 {
-    auto [start_byte, size] = rand_start_and_size();
-
-    std::cout << std::format("Read  at {} size {}  ", start_byte, size);
-
     std::vector<uint8_t> buffer1(size);
     std::vector<uint8_t> buffer2(size);
     // Write to both fs and bs
@@ -194,19 +205,41 @@ void one_read(ImageBackingStore &bs)
     }
 }
 
-int main()
+// Writes zeros to fs and bs
+void zero_at(ImageBackingStore &bs, uint32_t start_byte, uint32_t size)
 {
-    ImageBackingStore bs("", "");
+    std::vector<uint8_t> buffer(size, 0);
+    fs.seek(start_byte);
+    fs.write(buffer.data(), size);
+    bs.set_position(start_byte);
+    bs.cow_write(buffer.data(), size);
+}
 
-    //  Start with identical data in both fs and bs original file
-    gen.seed(1);
-    fillWithPseudoRandom(fs.data());
-    gen.seed(1);
-    fillWithPseudoRandom(bs.getOriginalFile().data());
+template <typename Store>
+void one_write(Store &bs)
+{
+    auto [start_byte, size] = rand_start_and_size();
 
-    check_integrity(bs);
+    std::cout << std::format("Write at {} size {} ", start_byte, size);
+
+    write_at(bs, start_byte, size);
+}
+
+template <typename Store>
+void one_read(Store &bs)
+{
+    auto [start_byte, size] = rand_start_and_size();
+
+    std::cout << std::format("Read  at {} size {}  ", start_byte, size);
+
+    read_at(bs, start_byte, size);
+}
 
-    for (int i = 0; i < 100000; i++)
+// Runs random write-then-read pairs, checking every read against fs
+template <typename Store>
+void run_random_ops(Store &bs, int iterations)
+{
+    for (int i = 0; i < iterations; i++)
     {
         std::cout << std::format("{}: ", i);
         one_write(bs);
@@ -219,6 +252,1312 @@ int main()
             bs.resetStats();
         }
     }
+}
+
+// Checks that a persisted bitmap brings the overlay back after the store is reopened
+void test_persistence(bool compact_overlay)
+{
+    create_image("persist.img");
+    ImageBackingStoreOptions options;
+    options.bitmap_filename = compact_overlay ? "compact.map" : "persist.map";
+    options.compact_overlay = compact_overlay;
+    options.staging_buffer_size = compact_overlay ? 16384 : 0; // Small enough that long writes only stage their edges
+    const char *dirty_filename = compact_overlay ? "compact.cow" : "persist.cow";
+
+    {
+        ImageBackingStore bs("persist.img", dirty_filename, options);
+
+        gen.seed(2);
+        fillWithPseudoRandom(fs.data());
+        gen.seed(2);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+
+        run_random_ops(bs, 1000);
+        check_integrity(bs);
+    }
+
+    // Reopening must resume the overlay instead of starting from the original
+    ImageBackingStore bs("persist.img", dirty_filename, options);
+    check_integrity(bs);
+    run_random_ops(bs, 1000);
+    check_integrity(bs);
+}
+
+// Runs the random workload with groups rounded up to a power of two (8 sectors instead of 5)
+// COW copies of such groups take two chunks, which exercises the double buffered copy
+void test_pow2_groups()
+{
+    ImageBackingStoreOptions options;
+    options.group_sizing = CowGroupSizing::PowerOfTwo;
+    options.double_buffer_copy = true;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(3);
+    fillWithPseudoRandom(fs.data());
+    gen.seed(3);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+
+    run_random_ops(bs, 2000);
+    check_integrity(bs);
+}
+
+// Writes longer than the staging buffer still stage their partial edge groups (5 sectors each),
+// only the fully covered groups in between go straight to the overlay
+void test_staging()
+{
+    ImageBackingStoreOptions options;
+    options.staging_buffer_size = 4096;
+    ImageBackingStore bs("", "", options);
+    gen.seed(31);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+
+    write_at(bs, 3 * 512, 64 * 512);
+    // 3 sectors preserved on each side, each read and then written again
+    CowStats counters = bs.statistics();
+    if (counters.staged_writes != 2 || counters.cow_copy_chunks != 0 || counters.overWrite() != 100.0 * 12 / 64)
+    {
+        std::cout << std::format("Long write did not stage its edges: {}\n", bs.stats());
+        exit(1);
+    }
+    check_integrity(bs);
+
+    run_random_ops(bs, 1000);
+    check_integrity(bs);
+}
+
+// Hammers a small "metadata" area with small reads and writes through the read cache
+void test_read_cache()
+{
+    ImageBackingStoreOptions options;
+    options.read_cache = true;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(4);
+    fillWithPseudoRandom(fs.data());
+    gen.seed(4);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+
+    const uint32_t metadata_sectors = 256;
+    for (int i = 0; i < 20000; i++)
+    {
+        uint32_t num_sectors = rand_int(1, 16);
+        uint32_t start_byte = rand_int(0, metadata_sectors - num_sectors) * 512;
+        uint32_t size = num_sectors * 512;
+
+        if (rand_int(0, 9) == 0)
+        {
+            write_at(bs, start_byte, size);
+        }
+        read_at(bs, start_byte, size);
+    }
+    std::cout << std::format("{}\n", bs.stats());
+
+    run_random_ops(bs, 2000);
+    check_integrity(bs);
+}
+
+// Streams through the image with small sequential reads (read-ahead) while writing ahead of the
+// reader and doing the odd random read (read-ahead turned off)
+void test_read_ahead()
+{
+    ImageBackingStoreOptions options;
+    options.read_ahead_sectors = 64;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(5);
+    fillWithPseudoRandom(fs.data());
+    gen.seed(5);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+
+    uint32_t position = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+        uint32_t size = rand_int(1, 16) * 512;
+        if (position + size > fs.size() || rand_int(0, 49) == 0)
+        {
+            position = rand_int(0, fs.size() / 512 - 16) * 512;
+        }
+
+        if (rand_int(0, 9) == 0)
+        {
+            // Overwrites data that may be prefetched already
+            uint32_t write_size = rand_int(1, 16) * 512;
+            uint32_t write_start = std::min<uint32_t>(position + rand_int(0, 64) * 512, fs.size() - write_size);
+            write_at(bs, write_start, write_size);
+        }
+
+        read_at(bs, position, size);
+        position += size;
+    }
+    std::cout << std::format("{}\n", bs.stats());
+
+    run_random_ops(bs, 2000);
+    check_integrity(bs);
+}
+
+// Commits the overlay in small steps interleaved with random I/O, then checks the original alone
+void test_commit()
+{
+    ImageBackingStoreOptions options;
+    options.writable_original = true;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(6);
+    fillWithPseudoRandom(fs.data());
+    gen.seed(6);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+
+    run_random_ops(bs, 2000);
+    for (int i = 0; i < 2000; i++)
+    {
+        if (bs.commitStep(4) < 0)
+        {
+            std::cout << "Commit step failed" << std::endl;
+            exit(1);
+        }
+        one_write(bs);
+        one_read(bs);
+        std::cout << std::format("{} dirty groups left\n", bs.dirtyGroupCount());
+    }
+    check_integrity(bs);
+
+    // Once everything is committed the original holds the whole image
+    while (bs.commitStep(64) > 0)
+    {
+    }
+    if (bs.dirtyGroupCount() != 0 || bs.getOriginalFile().data() != fs.data())
+    {
+        std::cout << "Original differs after commit" << std::endl;
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+// Discards a persistent compact overlay and checks the original comes back, also after reopening
+void test_discard()
+{
+    create_image("discard.img");
+    ImageBackingStoreOptions options;
+    options.bitmap_filename = "discard.map";
+    options.compact_overlay = true;
+
+    {
+        ImageBackingStore bs("discard.img", "discard.cow", options);
+
+        gen.seed(7);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+
+        run_random_ops(bs, 1000);
+        if (!bs.discard() || bs.dirtyGroupCount() != 0)
+        {
+            std::cout << "Discard failed" << std::endl;
+            exit(1);
+        }
+        fs.data() = bs.getOriginalFile().data();
+        check_integrity(bs);
+
+        // Rewrite after the discard, then discard again before closing
+        run_random_ops(bs, 1000);
+        check_integrity(bs);
+        bs.discard();
+        fs.data() = bs.getOriginalFile().data();
+    }
+
+    ImageBackingStore bs("discard.img", "discard.cow", options);
+    check_integrity(bs);
+    run_random_ops(bs, 1000);
+    check_integrity(bs);
+}
+
+// Builds a stack of two base layers (plain then compact) over an original in three sessions,
+// each session reading through everything below it
+void test_layers()
+{
+    create_image("layers.img");
+    ImageBackingStoreOptions options;
+    options.bitmap_filename = "layer1.map";
+
+    {
+        ImageBackingStore bs("layers.img", "layer1.cow", options);
+
+        gen.seed(8);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+
+        run_random_ops(bs, 1000);
+    }
+
+    const CowLayerFiles layers[] = {{"layer1.cow", "layer1.map"}, {"layer2.cow", "layer2.map"}};
+    options.base_layers = layers;
+    options.base_layer_count = 1;
+    options.bitmap_filename = "layer2.map";
+    options.compact_overlay = true;
+    {
+        ImageBackingStore bs("layers.img", "layer2.cow", options);
+        check_integrity(bs);
+        run_random_ops(bs, 1000);
+        check_integrity(bs);
+    }
+
+    // Scratch session on top of both layers, overlay kept in RAM only
+    options.base_layer_count = 2;
+    options.bitmap_filename = nullptr;
+    options.compact_overlay = false;
+    options.staging_buffer_size = 16384;
+    ImageBackingStore bs("layers.img", "", options);
+    check_integrity(bs);
+    run_random_ops(bs, 1000);
+    check_integrity(bs);
+}
+
+// Runs two LUNs over one shared original, each with its own overlay, checking neither sees the other
+void test_shared_base()
+{
+    create_image("shared.img");
+    CowSharedBase base("shared.img", 2048, 2);
+    gen.seed(9);
+    fillWithPseudoRandom(base.file().data());
+    const std::vector<uint8_t> original = base.file().data();
+
+    ImageBackingStoreOptions options;
+    options.shared_base = &base;
+    options.double_buffer_copy = true;
+    ImageBackingStore lun0(nullptr, "lun0.cow", options);
+    ImageBackingStore lun1(nullptr, "lun1.cow", options);
+
+    // fs holds the expected image of lun0, other_lun the one of lun1 (swapped while lun1 runs)
+    std::vector<uint8_t> other_lun = original;
+    fs.data() = original;
+    for (int i = 0; i < 10; i++)
+    {
+        run_random_ops(lun0, 100);
+        std::swap(fs.data(), other_lun);
+        run_random_ops(lun1, 100);
+        check_integrity(lun1);
+        std::swap(fs.data(), other_lun);
+        check_integrity(lun0);
+    }
+
+    if (base.users() != 2 || base.file().data() != original)
+    {
+        std::cout << "Shared base modified" << std::endl;
+        exit(1);
+    }
+}
+
+// Swaps images several times on one static arena, with every optional buffer enabled
+constexpr ImageBackingStoreOptions kArenaOptions{.compact_overlay = true,
+                                                 .double_buffer_copy = true,
+                                                 .staging_buffer_size = 16384,
+                                                 .read_cache = true,
+                                                 .read_ahead_sectors = 32};
+static CowStaticArena<ImageBackingStore::arenaSize(kArenaOptions)> arena;
+
+void test_arena()
+{
+    ImageBackingStoreOptions options = kArenaOptions;
+    options.arena = arena.data;
+    options.arena_size = sizeof(arena.data);
+
+    for (int i = 0; i < 3; i++)
+    {
+        ImageBackingStore bs("", "", options);
+
+        gen.seed(10 + i);
+        fillWithPseudoRandom(fs.data());
+        gen.seed(10 + i);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+
+        run_random_ops(bs, 1000);
+        check_integrity(bs);
+    }
+
+    // An arena that is too small fails construction instead of overrunning
+    options.arena_size = 1024;
+    try
+    {
+        ImageBackingStore bs("", "", options);
+        std::cout << "Arena overrun not detected" << std::endl;
+        exit(1);
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+}
+
+// Zeroes random ranges (up to 1000 sectors, as a format would) between random I/O
+void run_zero_ops(ImageBackingStore &bs, int iterations)
+{
+    for (int i = 0; i < iterations; i++)
+    {
+        uint32_t num_sectors = rand_int(1, 1000);
+        uint32_t start_sector = rand_int(0, fs.size() / 512 - num_sectors);
+        zero_at(bs, start_sector * 512, num_sectors * 512);
+        run_random_ops(bs, 10);
+    }
+}
+
+// Zeroes ranges of a persistent compact overlay, reopens it, then reads it as a base layer
+void test_zero_groups()
+{
+    create_image("zero.img");
+    ImageBackingStoreOptions options;
+    options.zero_groups = true;
+    options.bitmap_filename = "zero.map";
+    options.compact_overlay = true;
+    options.staging_buffer_size = 16384;
+
+    {
+        ImageBackingStore bs("zero.img", "zero.cow", options);
+
+        gen.seed(11);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+
+        run_zero_ops(bs, 100);
+        check_integrity(bs);
+    }
+
+    {
+        ImageBackingStore bs("zero.img", "zero.cow", options);
+        check_integrity(bs);
+        run_zero_ops(bs, 100);
+        check_integrity(bs);
+    }
+
+    // Zeroing the whole image writes nothing to the overlay
+    const CowLayerFiles layers[] = {{"zero.cow", "zero.map"}};
+    options.base_layers = layers;
+    options.base_layer_count = 1;
+    options.bitmap_filename = nullptr;
+    options.compact_overlay = false;
+    ImageBackingStore bs("zero.img", "", options);
+    check_integrity(bs);
+    run_zero_ops(bs, 100);
+    check_integrity(bs);
+    bs.resetStats();
+    zero_at(bs, 0, fs.size());
+    check_integrity(bs);
+    if (bs.statistics().overWrite() != -100.0)
+    {
+        std::cout << "Zero write reached the overlay" << std::endl;
+        exit(1);
+    }
+
+    // Reading it back reads nothing either, which counts as exactly what was requested in both reports
+    bs.resetStats();
+    read_at(bs, 0, 1024 * 1024);
+    std::ostringstream output;
+    std::streambuf *stdout_buffer = std::cout.rdbuf(output.rdbuf());
+    bs.dumpstats();
+    std::cout.rdbuf(stdout_buffer);
+    if (bs.statistics().overRead() != 0.0 || output.str().find(" Over-read  : 0.00%") == std::string::npos)
+    {
+        std::cout << std::format("Zero groups over-read {:.2f}%, dumpstats() printed:\n{}", bs.statistics().overRead(), output.str());
+        exit(1);
+    }
+}
+
+// Unmaps [start_byte, start_byte + size) of bs, checking each sector reads back as before, as zeros
+// or as the original, and then takes what bs returns as the new content of fs
+void unmap_at(ImageBackingStore &bs, uint32_t start_byte, uint32_t size)
+{
+    bs.set_position(start_byte);
+    bs.cow_unmap(size);
+
+    std::vector<uint8_t> buffer(size);
+    bs.set_position(start_byte);
+    bs.cow_read(buffer.data(), size);
+    const std::vector<uint8_t> zero(512, 0);
+    for (uint32_t offset = 0; offset < size; offset += 512)
+    {
+        const uint8_t *sector = buffer.data() + offset;
+        if (memcmp(sector, fs.data().data() + start_byte + offset, 512) != 0 && memcmp(sector, zero.data(), 512) != 0 &&
+            memcmp(sector, bs.getOriginalFile().data().data() + start_byte + offset, 512) != 0)
+        {
+            std::cout << std::format("Unmapped sector {} reads back garbage\n", (start_byte + offset) / 512);
+            exit(1);
+        }
+    }
+    std::copy(buffer.begin(), buffer.end(), fs.data().begin() + start_byte);
+}
+
+// Unmaps random ranges between random I/O, with groups becoming ZERO then reverting to the original
+void test_unmap()
+{
+    create_image("unmap.img");
+    ImageBackingStoreOptions options;
+    options.zero_groups = true;
+    options.compact_overlay = true;
+    options.read_cache = true;
+
+    {
+        ImageBackingStore bs("", "", options);
+
+        gen.seed(12);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+
+        for (int i = 0; i < 200; i++)
+        {
+            uint32_t num_sectors = rand_int(1, 1000);
+            unmap_at(bs, rand_int(0, fs.size() / 512 - num_sectors) * 512, num_sectors * 512);
+            run_random_ops(bs, 10);
+        }
+        check_integrity(bs);
+    }
+
+    // Unmapped slots are taken by the next groups written, also after the store is reopened
+    options.bitmap_filename = "unmap.map";
+    {
+        ImageBackingStore bs("unmap.img", "unmap.cow", options);
+        gen.seed(14);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+        write_at(bs, 400 * 2560, 100 * 2560); // 100 whole groups
+        unmap_at(bs, 400 * 2560, 100 * 2560);
+        bs.flush();
+        write_at(bs, 600 * 2560, 100 * 2560);
+        unmap_at(bs, 600 * 2560, 100 * 2560);
+        bs.flush();
+        if (bs.overlaySlotCount() != 100)
+        {
+            std::cout << std::format("Overlay grew to {} slots after unmap\n", bs.overlaySlotCount());
+            exit(1);
+        }
+        check_integrity(bs);
+    }
+    {
+        ImageBackingStore bs("unmap.img", "unmap.cow", options);
+        write_at(bs, 800 * 2560, 100 * 2560);
+        if (bs.overlaySlotCount() != 100)
+        {
+            std::cout << std::format("Reopened overlay grew to {} slots\n", bs.overlaySlotCount());
+            exit(1);
+        }
+        check_integrity(bs);
+        run_random_ops(bs, 100);
+        check_integrity(bs);
+    }
+    options.bitmap_filename = nullptr;
+
+    // Without zero groups unmapping everything gives the original back
+    options.zero_groups = false;
+    ImageBackingStore bs("", "", options);
+    gen.seed(13);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+    run_random_ops(bs, 1000);
+    unmap_at(bs, 0, fs.size());
+    if (bs.dirtyGroupCount() != 0 || bs.recreate() != bs.getOriginalFile().data())
+    {
+        std::cout << "Unmap left dirty groups" << std::endl;
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+// Splits random requests into up to 4 segments with separate buffers, mostly contiguous on disk
+// (a wrapping ring buffer) and sometimes not, and checks them against fs
+void test_vectored()
+{
+    ImageBackingStoreOptions options;
+    options.staging_buffer_size = 16384;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(14);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+
+    for (int i = 0; i < 5000; i++)
+    {
+        bool write = rand_int(0, 1) == 0;
+        uint32_t segment_count = rand_int(1, 4);
+        std::vector<std::vector<uint8_t>> buffers(segment_count);
+        std::vector<CowIoSegment> segments(segment_count);
+        uint32_t lba = rand_int(0, fs.size() / 512 - 64 * segment_count);
+        for (uint32_t j = 0; j < segment_count; j++)
+        {
+            if (rand_int(0, 4) == 0)
+            {
+                lba = rand_int(0, fs.size() / 512 - 64); // Jump elsewhere
+            }
+            uint32_t num_sectors = rand_int(1, 16);
+            buffers[j].resize(num_sectors * 512);
+            if (write)
+            {
+                fillWithPseudoRandom(buffers[j]);
+                std::copy(buffers[j].begin(), buffers[j].end(), fs.data().begin() + lba * 512);
+            }
+            segments[j] = {lba, buffers[j].data(), num_sectors * 512};
+            lba += num_sectors;
+        }
+
+        if (write)
+        {
+            bs.cow_writev(segments.data(), segment_count);
+            continue;
+        }
+        bs.cow_readv(segments.data(), segment_count);
+        for (uint32_t j = 0; j < segment_count; j++)
+        {
+            if (memcmp(buffers[j].data(), fs.data().data() + segments[j].lba * 512, segments[j].count) != 0)
+            {
+                std::cout << std::format("Vectored read of segment {} at {} differs\n", j, segments[j].lba);
+                exit(1);
+            }
+        }
+    }
+    std::cout << std::format("{}\n", bs.stats());
+    check_integrity(bs);
+}
+
+// Completion state of one asynchronous request in test_async
+struct AsyncCheck
+{
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> expected; // Empty for writes
+    uint32_t lba;
+    ssize_t done = 0;
+    bool complete = false;
+};
+
+void async_done(void *context, ssize_t result, bool complete)
+{
+    AsyncCheck &check = *static_cast<AsyncCheck *>(context);
+    if (result < check.done || check.complete)
+    {
+        std::cout << "Async progress went backwards" << std::endl;
+        exit(1);
+    }
+    check.done = result;
+    check.complete = complete;
+}
+
+// Keeps the asynchronous queue full of random reads and writes, checking reads against fs as it was
+// when they were submitted (requests run in order)
+void test_async()
+{
+    ImageBackingStoreOptions options;
+    options.async_chunk_sectors = 4;
+    options.read_ahead_sectors = 32;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(15);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+
+    std::vector<AsyncCheck> checks(ZULU_COW_ASYNC_QUEUE_DEPTH * 1000);
+    size_t submitted = 0;
+    size_t finished = 0;
+    while (finished < checks.size())
+    {
+        while (submitted < checks.size())
+        {
+            AsyncCheck &check = checks[submitted];
+            auto [start_byte, size] = rand_start_and_size();
+            check.lba = start_byte / 512;
+            check.buffer.resize(size);
+            bool write = rand_int(0, 1) == 0;
+            if (write)
+            {
+                fillWithPseudoRandom(check.buffer);
+            }
+            bool queued = write ? bs.cow_submit_write(check.lba, check.buffer.data(), size, async_done, &check)
+                                : bs.cow_submit_read(check.lba, check.buffer.data(), size, async_done, &check);
+            if (!queued)
+            {
+                break;
+            }
+            if (write)
+            {
+                std::copy(check.buffer.begin(), check.buffer.end(), fs.data().begin() + start_byte);
+            }
+            else
+            {
+                check.expected.assign(fs.data().begin() + start_byte, fs.data().begin() + start_byte + size);
+            }
+            submitted++;
+        }
+
+        bs.poll();
+        for (; finished < submitted && checks[finished].complete; finished++)
+        {
+            AsyncCheck &check = checks[finished];
+            if (check.done != static_cast<ssize_t>(check.buffer.size()) || (!check.expected.empty() && check.expected != check.buffer))
+            {
+                std::cout << std::format("Async request {} at {} failed\n", finished, check.lba);
+                exit(1);
+            }
+            check.buffer.clear();
+        }
+    }
+
+    if (bs.poll() || bs.pendingRequests() != 0)
+    {
+        std::cout << "Async queue not empty" << std::endl;
+        exit(1);
+    }
+    std::cout << std::format("{}\n", bs.stats());
+    check_integrity(bs);
+
+    // Synchronous reads and writes between the polls of a long write on a clean store: sectors 0 to 79
+    // read back the request up to its progress and what was there before elsewhere, writes land next
+    // to it in its partial edge groups (sectors 5 to 9 and 70 to 74)
+    ImageBackingStore clean("", "", options);
+    fillWithPseudoRandom(clean.getOriginalFile().data());
+    fs.data() = clean.getOriginalFile().data();
+    const uint32_t edge_sectors[] = {5, 6, 71, 72, 73, 74};
+    AsyncCheck check;
+    check.lba = 7;
+    check.buffer.resize(64 * 512);
+    fillWithPseudoRandom(check.buffer);
+    clean.cow_submit_write(check.lba, check.buffer.data(), check.buffer.size(), async_done, &check);
+    while (!check.complete)
+    {
+        clean.poll();
+        std::vector<uint8_t> expected(fs.data().begin(), fs.data().begin() + 80 * 512);
+        std::copy(check.buffer.begin(), check.buffer.begin() + check.done, expected.begin() + check.lba * 512);
+        std::vector<uint8_t> buffer(expected.size());
+        clean.set_position(0);
+        if (clean.cow_read(buffer.data(), buffer.size()) != static_cast<ssize_t>(buffer.size()) || buffer != expected)
+        {
+            std::cout << std::format("Read after {} bytes of async write differs\n", check.done);
+            exit(1);
+        }
+        write_at(clean, edge_sectors[rand_int(0, 5)] * 512, 512);
+    }
+    std::copy(check.buffer.begin(), check.buffer.end(), fs.data().begin() + check.lba * 512);
+    check_integrity(clean);
+}
+
+// Gathers [start_byte, start_byte + size) through cow_read_spans() with few spans per call
+std::vector<uint8_t> read_spans(ImageBackingStore &bs, uint32_t start_byte, uint32_t size)
+{
+    std::vector<uint8_t> buffer;
+    bs.set_position(start_byte);
+    while (buffer.size() < size)
+    {
+        CowSpan spans[3];
+        uint32_t span_count = 3;
+        ssize_t covered = bs.cow_read_spans(size - buffer.size(), spans, span_count);
+        if (covered <= 0 || span_count == 0)
+        {
+            std::cout << std::format("Span read at {} failed\n", start_byte + buffer.size());
+            exit(1);
+        }
+        for (uint32_t i = 0; i < span_count; i++)
+        {
+            if (spans[i].data == nullptr)
+            {
+                buffer.insert(buffer.end(), spans[i].size, 0);
+            }
+            else
+            {
+                buffer.insert(buffer.end(), spans[i].data, spans[i].data + spans[i].size);
+            }
+        }
+    }
+    return buffer;
+}
+
+// Span reads of random ranges over an overlay with compacted and zero groups, then over base layers
+void test_spans()
+{
+    ImageBackingStoreOptions options;
+    options.compact_overlay = true;
+    options.zero_groups = true;
+
+    {
+        ImageBackingStore bs("", "", options);
+
+        gen.seed(16);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+        run_zero_ops(bs, 2000);
+
+        for (int i = 0; i < 2000; i++)
+        {
+            auto [start_byte, size] = rand_start_and_size();
+            std::vector<uint8_t> buffer = read_spans(bs, start_byte, size);
+            if (!std::equal(buffer.begin(), buffer.end(), fs.data().begin() + start_byte))
+            {
+                std::cout << std::format("Span read at {} differs\n", start_byte);
+                exit(1);
+            }
+            if (i % 10 == 0)
+            {
+                run_zero_ops(bs, 1);
+            }
+        }
+        check_integrity(bs);
+    }
+
+    // Reuse the two layers left by test_layers()
+    const CowLayerFiles layers[] = {{"layer1.cow", "layer1.map"}, {"layer2.cow", "layer2.map"}};
+    options.base_layers = layers;
+    options.base_layer_count = 2;
+    ImageBackingStore bs("layers.img", "", options);
+    fs.data() = bs.recreate();
+    gen.seed(17);
+    run_random_ops(bs, 100);
+    if (read_spans(bs, 0, fs.size()) != fs.data())
+    {
+        std::cout << "Span read over base layers differs" << std::endl;
+        exit(1);
+    }
+}
+
+// Sink appending exported data to a std::vector
+bool export_to_vector(void *context, const void *data, uint32_t size)
+{
+    std::vector<uint8_t> &out = *static_cast<std::vector<uint8_t> *>(context);
+    out.insert(out.end(), static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size);
+    return true;
+}
+
+// Exports a session over base layers with zero groups in full through an odd-sized buffer, then as a
+// delta that is split into a sidecar and an overlay and reopened over the bare original
+void test_export()
+{
+    const CowLayerFiles layers[] = {{"layer1.cow", "layer1.map"}, {"layer2.cow", "layer2.map"}};
+    ImageBackingStoreOptions options;
+    options.compact_overlay = true;
+    options.zero_groups = true;
+    options.base_layers = layers;
+    options.base_layer_count = 2;
+
+    std::vector<uint8_t> delta;
+    {
+        ImageBackingStore bs("layers.img", "", options);
+        fs.data() = bs.recreate();
+        gen.seed(18);
+        run_zero_ops(bs, 200);
+
+        std::vector<uint8_t> image;
+        std::vector<uint8_t> buffer(3000);
+        if (bs.exportImage(CowExportFormat::Full, export_to_vector, &image, buffer.data(), buffer.size()) !=
+                static_cast<ssize_t>(fs.size()) ||
+            image != fs.data())
+        {
+            std::cout << "Full export differs" << std::endl;
+            exit(1);
+        }
+
+        if (bs.exportImage(CowExportFormat::Delta, export_to_vector, &delta) != static_cast<ssize_t>(delta.size()) ||
+            delta.size() >= fs.size())
+        {
+            std::cout << std::format("Delta export failed, {} bytes\n", delta.size());
+            exit(1);
+        }
+
+        FsFile sidecar;
+        FsFile overlay;
+        sidecar.open("delta.map", O_RDWR | O_CREAT);
+        overlay.open("delta.cow", O_RDWR | O_CREAT);
+        sidecar.write_at(0, delta.data(), bs.deltaSidecarSize());
+        overlay.write_at(0, delta.data() + bs.deltaSidecarSize(), delta.size() - bs.deltaSidecarSize());
+    }
+
+    options.base_layers = nullptr;
+    options.base_layer_count = 0;
+    options.bitmap_filename = "delta.map";
+    ImageBackingStore bs("layers.img", "delta.cow", options);
+    if (bs.dirtyGroupCount() == 0)
+    {
+        std::cout << "Delta sidecar not loaded" << std::endl;
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+void trace_to_vector(void *context, const CowTraceRecord &record)
+{
+    static_cast<std::vector<CowTraceRecord> *>(context)->push_back(record);
+}
+
+// Records random reads, writes and unmaps through the trace hook and checks each record
+void test_trace()
+{
+    ImageBackingStoreOptions options;
+    options.zero_groups = true;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(19);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+
+    std::vector<CowTraceRecord> trace;
+    std::vector<CowTraceRecord> expected;
+    bs.setTraceHook(trace_to_vector, &trace);
+    for (int i = 0; i < 1000; i++)
+    {
+        auto [start_byte, size] = rand_start_and_size();
+        CowTraceOp op = static_cast<CowTraceOp>(rand_int(0, 2));
+        expected.push_back({0, start_byte / 512, size, op, 0});
+        if (op == CowTraceOp::Read)
+        {
+            read_at(bs, start_byte, size);
+        }
+        else if (op == CowTraceOp::Write)
+        {
+            write_at(bs, start_byte, size);
+        }
+        else
+        {
+            unmap_at(bs, start_byte, size); // Reads the range back, which is traced too
+            expected.push_back({0, start_byte / 512, size, CowTraceOp::Read, 0});
+        }
+    }
+    bs.setTraceHook(nullptr, nullptr);
+    read_at(bs, 0, 512); // Not traced anymore
+
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        if (i >= trace.size() || trace[i].lba != expected[i].lba || trace[i].count != expected[i].count || trace[i].op != expected[i].op ||
+            (i > 0 && trace[i].timestamp_us < trace[i - 1].timestamp_us))
+        {
+            std::cout << std::format("Trace record {} differs\n", i);
+            exit(1);
+        }
+    }
+    if (trace.size() != expected.size())
+    {
+        std::cout << std::format("{} trace records, expected {}\n", trace.size(), expected.size());
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+uint64_t histogram_total(const auto &histogram)
+{
+    uint64_t total = 0;
+    for (uint64_t count : histogram)
+    {
+        total += count;
+    }
+    return total;
+}
+
+// Checks every public read and write is timed and has its file calls counted
+void test_instrumentation()
+{
+    ImageBackingStore bs("", "");
+    gen.seed(20);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+
+    read_at(bs, 0, 4096); // Clean: one read from the original
+    run_random_ops(bs, 500);
+    CowInstrumentation counters = bs.instrumentation();
+
+#if ZULU_COW_INSTRUMENTATION
+    bool ok = histogram_total(counters.read_latency) == 501 && histogram_total(counters.read_calls) == 501 &&
+              histogram_total(counters.write_latency) == 500 && histogram_total(counters.write_calls) == 500 &&
+              counters.read_calls[1] > 0 && counters.file_reads > 501 && counters.file_writes >= 500 &&
+              counters.file_seeks == 0 && // The mock has positional I/O
+              histogram_total(counters.copy_latency) > 0;
+#else
+    bool ok = counters.file_reads == 0 && histogram_total(counters.read_latency) == 0;
+#endif
+    bs.resetInstrumentation();
+    if (!ok || bs.instrumentation().file_reads != 0)
+    {
+        std::cout << "Instrumentation counters are wrong" << std::endl;
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+// Small writes into large groups with split groups: random and zero ops, span reads, reopening
+// a persistent overlay (split groups are settled on flush) and committing
+void test_split_groups()
+{
+    create_image("split.img");
+    ImageBackingStoreOptions options;
+    options.bitmap_size = 64; // Large groups
+    options.split_groups = 8;
+
+    {
+        // One sector in a clean group copies a sub-group rather than the group
+        ImageBackingStore bs("", "", options);
+        ImageBackingStoreOptions whole_options = options;
+        whole_options.split_groups = 0;
+        ImageBackingStore whole("", "", whole_options);
+        gen.seed(21);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+        whole.getOriginalFile().data() = fs.data();
+        write_at(whole, 3 * 512, 512); // Only bs is checked against fs
+        write_at(bs, 3 * 512, 512);
+        if (bs.statistics().overWrite() >= whole.statistics().overWrite() || bs.statistics().groups_split != 1)
+        {
+            std::cout << "Small write copied the whole group" << std::endl;
+            exit(1);
+        }
+        check_integrity(bs);
+    }
+
+    options.zero_groups = true;
+    options.compact_overlay = true;
+    options.bitmap_filename = "split.map";
+    {
+        ImageBackingStore bs("split.img", "split.cow", options);
+        gen.seed(22);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+        run_zero_ops(bs, 200);
+        for (int i = 0; i < 200; i++)
+        {
+            auto [start_byte, size] = rand_start_and_size();
+            if (!std::equal(fs.data().begin() + start_byte, fs.data().begin() + start_byte + size, read_spans(bs, start_byte, size).begin()))
+            {
+                std::cout << std::format("Span read at {} differs\n", start_byte);
+                exit(1);
+            }
+            one_write(bs);
+        }
+        check_integrity(bs);
+    }
+
+    {
+        ImageBackingStore bs("split.img", "split.cow", options);
+        check_integrity(bs);
+        run_zero_ops(bs, 100);
+        check_integrity(bs);
+    }
+
+    options.bitmap_filename = nullptr;
+    options.writable_original = true;
+    ImageBackingStore bs("", "", options);
+    gen.seed(23);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+    run_zero_ops(bs, 100);
+    while (bs.commitStep(64) > 0)
+    {
+    }
+    if (bs.dirtyGroupCount() != 0 || bs.getOriginalFile().data() != fs.data())
+    {
+        std::cout << "Original differs after committing split groups" << std::endl;
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+// Small writes into large groups settled by idle-time prefill steps, which keeps pool entries available
+void test_prefill()
+{
+    ImageBackingStoreOptions options;
+    options.bitmap_size = 64; // Large groups
+    options.split_groups = 4;
+    ImageBackingStore bs("", "", options);
+
+    gen.seed(24);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+
+    for (int i = 0; i < 500; i++)
+    {
+        write_at(bs, rand_int(0, fs.size() / 512 - 4) * 512, rand_int(1, 4) * 512);
+        one_read(bs);
+        if (i % 3 == 0 && bs.prefillStep(1) < 0)
+        {
+            std::cout << "Prefill step failed" << std::endl;
+            exit(1);
+        }
+    }
+    while (bs.prefillStep(2) > 0)
+    {
+    }
+    CowStats counters = bs.statistics();
+    if (bs.splitGroupCount() != 0 || counters.groups_split <= options.split_groups || counters.groups_prefilled != counters.groups_split)
+    {
+        std::cout << std::format("Prefill left split groups: {}\n", bs.stats());
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+// Sector by sector writes gathered by the write-back buffer: whole groups need no copy-on-write, reads
+// see buffered data, and the timer writes a run out
+void test_write_back()
+{
+    ImageBackingStoreOptions options;
+    options.write_back_size = 8192;
+
+    {
+        ImageBackingStore bs("", "", options);
+        gen.seed(25);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+
+        for (uint32_t sector = 0; sector < 1000; sector++)
+        {
+            write_at(bs, sector * 512, 512);
+            read_at(bs, (sector - sector % 8) * 512, 8 * 512);
+        }
+        if (!bs.flush() || bs.statistics().overWrite() != 0)
+        {
+            std::cout << std::format("Coalesced writes copied data: {}\n", bs.stats());
+            exit(1);
+        }
+        check_integrity(bs);
+
+        for (int i = 0; i < 200; i++)
+        {
+            uint32_t start_sector = rand_int(0, fs.size() / 512 - 16);
+            for (uint32_t sector = start_sector; sector < start_sector + rand_int(1, 16); sector++)
+            {
+                write_at(bs, sector * 512, 512);
+            }
+            run_random_ops(bs, 2);
+        }
+        check_integrity(bs);
+    }
+
+    options.write_back_delay_us = 0;
+    ImageBackingStore bs("", "", options);
+    fs.data() = bs.getOriginalFile().data();
+    write_at(bs, 512, 512);
+    if (!bs.writeBackTimer() || bs.statistics().writes_coalesced != 1 || bs.statistics().write_back_flushes != 1)
+    {
+        std::cout << "Write-back timer did not write the run" << std::endl;
+        exit(1);
+    }
+    check_integrity(bs);
+}
+
+// Positional calls leave the position alone. In concurrent builds, threads read and write their own
+// regions of one store at the same time (neighbouring regions share a group at their boundary)
+void test_concurrent()
+{
+    ImageBackingStoreOptions options;
+    options.writable_original = true;
+    ImageBackingStore bs("", "", options);
+    gen.seed(29);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+    fs.data() = bs.getOriginalFile().data();
+
+    std::vector<uint8_t> buffer(3000);
+    std::vector<uint8_t> readback(buffer.size());
+    fillWithPseudoRandom(buffer);
+    memcpy(fs.data().data() + 1000, buffer.data(), buffer.size());
+    bs.set_position(8192);
+    bool ok = bs.cow_write_at(1000, buffer.data(), buffer.size()) == 3000 &&
+              bs.cow_read_at(1000, readback.data(), readback.size()) == 3000 && readback == buffer;
+    readback.resize(512);
+    ok = ok && bs.cow_read(readback.data(), 512) == 512 &&
+         std::equal(readback.begin(), readback.end(), fs.data().begin() + 8192);
+    if (!ok)
+    {
+        std::cout << "Positional calls failed or moved the position" << std::endl;
+        exit(1);
+    }
+    check_integrity(bs);
+
+#if ZULU_COW_CONCURRENT
+    constexpr uint32_t kThreads = 4;
+    const uint32_t region = fs.size() / kThreads;
+    std::vector<std::vector<uint8_t>> expected(kThreads);
+    std::atomic<bool> failed = false;
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < kThreads; t++)
+    {
+        expected[t].assign(fs.data().begin() + t * region, fs.data().begin() + (t + 1) * region);
+        threads.emplace_back([&, t] {
+            std::mt19937 thread_gen(t);
+            std::uniform_int_distribution<uint32_t> sectors_dis(1, 32);
+            std::vector<uint8_t> data;
+            for (int i = 0; i < 3000 && !failed; i++)
+            {
+                uint32_t size = sectors_dis(thread_gen) * 512;
+                uint32_t start = std::uniform_int_distribution<uint32_t>(0, (region - size) / 512)(thread_gen) * 512;
+                uint64_t offset = uint64_t{t} * region + start;
+                data.resize(size);
+                if (i % 2 == 0)
+                {
+                    std::fill(data.begin(), data.end(), static_cast<uint8_t>(thread_gen()));
+                    memcpy(expected[t].data() + start, data.data(), size);
+                    failed = failed || bs.cow_write_at(offset, data.data(), size) != static_cast<ssize_t>(size);
+                }
+                else
+                {
+                    failed = failed || bs.cow_read_at(offset, data.data(), size) != static_cast<ssize_t>(size) ||
+                             memcmp(data.data(), expected[t].data() + start, size) != 0;
+                }
+                if (i % 500 == 0 && t == 0)
+                {
+                    failed = failed || !bs.flush() || bs.commitStep(4) < 0;
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    if (failed)
+    {
+        std::cout << std::format("Concurrent calls failed: {}\n", bs.stats());
+        exit(1);
+    }
+    for (uint32_t t = 0; t < kThreads; t++)
+    {
+        memcpy(fs.data().data() + t * region, expected[t].data(), region);
+    }
+    check_integrity(bs);
+#endif
+}
+
+// The fixed block size variants run the random workload like the runtime-sized store, and refuse another size
+void test_fixed_block_size()
+{
+    {
+        BasicImageBackingStore<512> bs("", "");
+        gen.seed(31);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+        run_random_ops(bs, 1000);
+        check_integrity(bs);
+    }
+
+    {
+        ImageBackingStoreOptions options;
+        options.scsi_block_size = 2048;
+        options.group_sizing = CowGroupSizing::PowerOfTwo;
+        BasicImageBackingStore<2048> bs("", "", options);
+        gen.seed(32);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+        run_random_ops(bs, 1000);
+        check_integrity(bs);
+    }
+
+    try
+    {
+        BasicImageBackingStore<2048> bs("", "", ImageBackingStoreOptions{});
+        std::cout << "Block size mismatch not detected" << std::endl;
+        exit(1);
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+}
+
+// A missing original, or one without a whole sector, fails construction instead of dividing by zero groups
+void test_open_errors()
+{
+    FsFile file;
+    file.open("short.img", O_RDWR | O_CREAT);
+    for (uint32_t size : {0u, 100u})
+    {
+        file.resize(size);
+        for (const char *name : {"missing.img", "short.img"})
+        {
+            try
+            {
+                ImageBackingStore bs(name, "");
+                std::cout << std::format("Opening {} ({} bytes) did not fail\n", name, size);
+                exit(1);
+            }
+            catch (const std::runtime_error &)
+            {
+            }
+        }
+    }
+}
+
+// Fast startup prints nothing and leaves the overlay unsized, reopening still resumes from the sidecar
+void test_fast_init()
+{
+    create_image("fast.img");
+    ImageBackingStoreOptions options;
+    options.bitmap_filename = "fast.map";
+    options.fast_init = true;
+    std::ostringstream output;
+    std::streambuf *stdout_buffer = std::cout.rdbuf(output.rdbuf());
+
+    {
+        ImageBackingStore bs("fast.img", "fast.cow", options);
+        std::cout.rdbuf(stdout_buffer);
+        gen.seed(30);
+        fillWithPseudoRandom(bs.getOriginalFile().data());
+        fs.data() = bs.getOriginalFile().data();
+
+        run_random_ops(bs, 500);
+        check_integrity(bs);
+        if (!output.str().empty() || bs.statistics().startup_us >= 1000000)
+        {
+            std::cout << std::format("Fast startup printed \"{}\" or took over a second\n", output.str());
+            exit(1);
+        }
+    }
+
+    stdout_buffer = std::cout.rdbuf(output.rdbuf());
+    ImageBackingStore bs("fast.img", "fast.cow", options);
+    bs.dumpGeometry();
+    std::cout.rdbuf(stdout_buffer);
+    if (output.str().find("Image size") != 0 || output.str().find("(resumed)") == std::string::npos)
+    {
+        std::cout << std::format("Fast startup did not resume or print its geometry when asked: {}\n", output.str());
+        exit(1);
+    }
+    check_integrity(bs);
+    run_random_ops(bs, 500);
+    check_integrity(bs);
+}
+
+int main()
+{
+    test_persistence(false);
+    test_persistence(true);
+    test_pow2_groups();
+    test_staging();
+    test_read_cache();
+#if !ZULU_COW_CONCURRENT // Read-ahead, write-back, split groups and shared bases fail construction
+    test_read_ahead();
+#endif
+    test_commit();
+    test_discard();
+    test_layers();
+#if !ZULU_COW_CONCURRENT
+    test_shared_base();
+    test_arena();
+#endif
+    test_zero_groups();
+    test_unmap();
+    test_vectored();
+#if !ZULU_COW_CONCURRENT
+    test_async();
+#endif
+    test_spans();
+    test_export();
+    test_trace();
+    test_instrumentation();
+#if !ZULU_COW_CONCURRENT
+    test_split_groups();
+    test_prefill();
+    test_write_back();
+#endif
+    test_concurrent();
+    test_fast_init();
+    test_fixed_block_size();
+    test_open_errors();
+
+    ImageBackingStore bs("", "");
+
+    //  Start with identical data in both fs and bs original file
+    gen.seed(1);
+    fillWithPseudoRandom(fs.data());
+    gen.seed(1);
+    fillWithPseudoRandom(bs.getOriginalFile().data());
+
+    check_integrity(bs);
+
+    run_random_ops(bs, 100000);
 
     return 0;
 }
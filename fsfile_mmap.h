@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * FsFile over a memory-mapped host file, for host tools and the emulator build
+ * Reads and writes are memcpy to and from the mapping, and map() gives direct
+ * access for ImageBackingStore::cow_read_spans()
+ * Writing past the end grows the file, doubling the mapping when it is full,
+ * which invalidates pointers returned by map(). The file is truncated back to
+ * its written size by sync() and close()
+ * Select it by building with -DZULU_COW_FSFILE_MMAP
+ */
+class FsFile
+{
+private:
+    int m_fd = -1;
+    bool m_writable = false;
+    uint8_t *m_map = nullptr;
+    uint64_t m_size = 0;      // Bytes of file content (written or present when opened)
+    uint64_t m_capacity = 0;  // Bytes mapped, m_size rounded up by growth
+    uint64_t m_file_size = 0; // Bytes of the file on disk, m_capacity or m_size once truncated
+    uint64_t m_position = 0;
+
+    bool remap(uint64_t capacity)
+    {
+        if (m_map != nullptr)
+        {
+            ::munmap(m_map, m_capacity);
+            m_map = nullptr;
+        }
+        m_capacity = capacity;
+        if (capacity == 0)
+        {
+            return true;
+        }
+        void *map = ::mmap(nullptr, capacity, PROT_READ | (m_writable ? PROT_WRITE : 0), MAP_SHARED, m_fd, 0);
+        if (map == MAP_FAILED)
+        {
+            m_capacity = 0;
+            return false;
+        }
+        m_map = static_cast<uint8_t *>(map);
+        return true;
+    }
+
+    // Makes [0, end) writable, remapping only when the mapping is full
+    // The mapping at least doubles, so a file grown a group at a time is remapped a logarithmic number of times
+    bool grow(uint64_t end)
+    {
+        uint64_t capacity = end > m_capacity ? std::max(end, 2 * m_capacity) : m_capacity;
+        if (capacity > m_file_size)
+        {
+            if (::ftruncate(m_fd, static_cast<off_t>(capacity)) != 0)
+            {
+                return false;
+            }
+            m_file_size = capacity;
+        }
+        if (capacity > m_capacity && !remap(capacity))
+        {
+            m_size = 0;
+            return false;
+        }
+        m_size = std::max(m_size, end);
+        return true;
+    }
+
+    // Drops the room grown beyond the content, the mapping stays as is (grow() extends the file again)
+    bool truncate()
+    {
+        if (m_file_size == m_size)
+        {
+            return true;
+        }
+        if (::ftruncate(m_fd, static_cast<off_t>(m_size)) != 0)
+        {
+            return false;
+        }
+        m_file_size = m_size;
+        return true;
+    }
+
+public:
+    FsFile() = default;
+    FsFile(const FsFile &) = delete;
+    FsFile &operator=(const FsFile &) = delete;
+    ~FsFile()
+    {
+        close();
+    }
+
+    /**
+     * Open and map the file with specified flags (O_RDONLY, O_RDWR, O_CREAT...)
+     */
+    bool open(const char *name, int flags)
+    {
+        close();
+        if (name == nullptr || name[0] == '\0')
+        {
+            return false;
+        }
+        m_fd = ::open(name, flags, 0644);
+        if (m_fd < 0)
+        {
+            return false;
+        }
+        m_writable = (flags & O_ACCMODE) != O_RDONLY;
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0 || !remap(static_cast<uint64_t>(st.st_size)))
+        {
+            close();
+            return false;
+        }
+        m_size = m_capacity;
+        m_file_size = m_capacity;
+        return true;
+    }
+
+    void close()
+    {
+        remap(0);
+        if (m_fd >= 0)
+        {
+            truncate();
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        m_size = 0;
+        m_file_size = 0;
+        m_position = 0;
+    }
+
+    bool isOpen() const
+    {
+        return m_fd >= 0;
+    }
+
+    /**
+     * Flush written data to the device, and truncate the file to it
+     */
+    bool sync()
+    {
+        return m_fd >= 0 && (m_map == nullptr || ::msync(m_map, m_size, MS_SYNC) == 0) && truncate();
+    }
+
+    /**
+     * Positional read, the current position is left unchanged
+     */
+    ssize_t read_at(uint64_t offset, void *buf, size_t count) const
+    {
+        if (offset >= m_size)
+        {
+            return 0; // EOF
+        }
+        size_t bytes_to_read = std::min<uint64_t>(count, m_size - offset);
+        std::memcpy(buf, m_map + offset, bytes_to_read);
+        return static_cast<ssize_t>(bytes_to_read);
+    }
+
+    /**
+     * Positional write, the current position is left unchanged
+     * Grows the file (and its mapping) when writing past the end
+     */
+    ssize_t write_at(uint64_t offset, const void *buf, size_t count)
+    {
+        if (!m_writable)
+        {
+            return -1;
+        }
+        if (offset + count > m_size && !grow(offset + count))
+        {
+            return -1;
+        }
+        std::memcpy(m_map + offset, buf, count);
+        return static_cast<ssize_t>(count);
+    }
+
+    /**
+     * Read data from the current position
+     */
+    ssize_t read(void *buf, size_t count)
+    {
+        ssize_t bytes_read = read_at(m_position, buf, count);
+        m_position += std::max<ssize_t>(bytes_read, 0);
+        return bytes_read;
+    }
+
+    /**
+     * Write data at the current position
+     */
+    ssize_t write(const void *buf, size_t count)
+    {
+        ssize_t bytes_written = write_at(m_position, buf, count);
+        m_position += std::max<ssize_t>(bytes_written, 0);
+        return bytes_written;
+    }
+
+    /**
+     * Direct access to 'count' bytes at 'offset', nullptr if out of bounds
+     * Valid until the file outgrows its mapping
+     */
+    const uint8_t *map(uint64_t offset, size_t count) const
+    {
+        if (offset > m_size || count > m_size - offset)
+        {
+            return nullptr;
+        }
+        return m_map + offset;
+    }
+
+    void seek(uint64_t position)
+    {
+        m_position = position;
+    }
+
+    uint64_t position() const
+    {
+        return m_position;
+    }
+
+    uint64_t size() const
+    {
+        return m_size;
+    }
+};
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <vector>
+#include <map>
+#include <memory>
+#include <string>
 #include <cstdint>
 #include <cstring>
 #include <algorithm>
@@ -11,23 +14,55 @@
 /**
  * Mock implementation of FsFile that uses in-memory storage
  * Backed by std::vector<uint8_t> and doesn't support writing out of bounds
+ * Files opened with the same non-empty name share their storage, so an
+ * image can be closed and reopened within a test
  */
 class FsFile
 {
 private:
-    std::vector<uint8_t> m_data;
+    std::shared_ptr<std::vector<uint8_t>> m_storage;
     size_t m_position;
 
+    static std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> &namedFiles()
+    {
+        static std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> files;
+        return files;
+    }
+
 public:
-    FsFile() : m_data(20 * 1024 * 1024), m_position(0) {}
+    FsFile() : m_storage(std::make_shared<std::vector<uint8_t>>(20 * 1024 * 1024)), m_position(0) {}
 
     /**
-     * Open file with specified flags and optional size
-     * For mock purposes, creates a buffer with the specified size
+     * Open file with specified flags
+     * An empty name keeps the private buffer, otherwise the storage registered
+     * under that name is used (the current buffer becomes that file if new)
+     * Like a real file, a name never opened before needs O_CREAT
      */
-    void open(const char *, int)
+    bool open(const char *name, int flags)
     {
         m_position = 0;
+        if (name != nullptr && name[0] != '\0')
+        {
+            auto found = namedFiles().find(name);
+            if (found == namedFiles().end())
+            {
+                if (!(flags & O_CREAT))
+                {
+                    return false;
+                }
+                found = namedFiles().emplace(name, m_storage).first;
+            }
+            m_storage = found->second;
+        }
+        return true;
+    }
+
+    /**
+     * Flush written data, always succeeds as everything is in memory
+     */
+    bool sync()
+    {
+        return true;
     }
 
     /**
@@ -35,13 +70,13 @@ public:
      */
     ssize_t read(void *buf, size_t count)
     {
-        size_t bytes_to_read = std::min(count, m_data.size() - m_position);
+        size_t bytes_to_read = std::min(count, m_storage->size() - m_position);
         if (bytes_to_read == 0)
         {
             return 0; // EOF
         }
 
-        std::memcpy(buf, m_data.data() + m_position, bytes_to_read);
+        std::memcpy(buf, m_storage->data() + m_position, bytes_to_read);
         m_position += bytes_to_read;
         return static_cast<ssize_t>(bytes_to_read);
     }
@@ -53,25 +88,67 @@ public:
     ssize_t write(const void *buf, size_t count)
     {
         // Check if write would go out of bounds
-        if (m_position >= m_data.size())
+        if (m_position >= m_storage->size())
         {
             return 0; // Can't write beyond fixed size
         }
 
-        size_t bytes_to_write = std::min(count, m_data.size() - m_position);
+        size_t bytes_to_write = std::min(count, m_storage->size() - m_position);
         if (bytes_to_write == 0)
         {
             return 0;
         }
 
-        std::memcpy(m_data.data() + m_position, buf, bytes_to_write);
+        std::memcpy(m_storage->data() + m_position, buf, bytes_to_write);
         m_position += bytes_to_write;
         return static_cast<ssize_t>(bytes_to_write);
     }
 
+    /**
+     * Positional read, the current position is left unchanged
+     */
+    ssize_t read_at(uint64_t offset, void *buf, size_t count) const
+    {
+        if (offset >= m_storage->size())
+        {
+            return 0; // EOF
+        }
+        size_t bytes_to_read = std::min<uint64_t>(count, m_storage->size() - offset);
+        std::memcpy(buf, m_storage->data() + offset, bytes_to_read);
+        return static_cast<ssize_t>(bytes_to_read);
+    }
+
+    /**
+     * Positional write, the current position is left unchanged
+     * Prevents writing beyond the fixed size
+     */
+    ssize_t write_at(uint64_t offset, const void *buf, size_t count)
+    {
+        if (offset >= m_storage->size())
+        {
+            return 0; // Can't write beyond fixed size
+        }
+        size_t bytes_to_write = std::min<uint64_t>(count, m_storage->size() - offset);
+        std::memcpy(m_storage->data() + offset, buf, bytes_to_write);
+        return static_cast<ssize_t>(bytes_to_write);
+    }
+
+    /**
+     * Direct access to 'count' bytes at 'offset', nullptr if out of bounds
+     * Valid until the file is resized
+     */
+    const uint8_t *map(uint64_t offset, size_t count) const
+    {
+        if (offset > m_storage->size() || count > m_storage->size() - offset)
+        {
+            return nullptr;
+        }
+        return m_storage->data() + offset;
+    }
+
     void seek(size_t position)
     {
-        m_position = std::min(position, m_data.size());
+        m_position = std::min(position, m_storage->size());
     }
 
     size_t position() const
@@ -81,23 +158,23 @@ public:
 
     size_t size() const
     {
-        return m_data.size();
+        return m_storage->size();
     }
 
     std::vector<uint8_t> &data()
     {
-        return m_data;
+        return *m_storage;
     }
 
     void set_data(const std::vector<uint8_t> &data)
     {
-        m_data = data;
+        *m_storage = data;
         m_position = 0;
     }
 
     void resize(size_t new_size)
     {
-        m_data.resize(new_size, 0);
+        m_storage->resize(new_size, 0);
         m_position = std::min(m_position, new_size);
     }
 };
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * FsFile over a real host file, for profiling against actual image files
+ * Same interface as the SdFat class (and the mock), plus positional
+ * read_at/write_at mapped to pread/pwrite
+ * Select it by building with -DZULU_COW_FSFILE_POSIX
+ */
+class FsFile
+{
+private:
+    int m_fd = -1;
+
+public:
+    FsFile() = default;
+    FsFile(const FsFile &) = delete;
+    FsFile &operator=(const FsFile &) = delete;
+    ~FsFile()
+    {
+        close();
+    }
+
+    /**
+     * Open file with specified flags (O_RDONLY, O_RDWR, O_CREAT...)
+     */
+    bool open(const char *name, int flags)
+    {
+        close();
+        if (name == nullptr || name[0] == '\0')
+        {
+            return false;
+        }
+        m_fd = ::open(name, flags, 0644);
+        return m_fd >= 0;
+    }
+
+    void close()
+    {
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    bool isOpen() const
+    {
+        return m_fd >= 0;
+    }
+
+    /**
+     * Flush written data to the device
+     */
+    bool sync()
+    {
+        return m_fd >= 0 && ::fsync(m_fd) == 0;
+    }
+
+    /**
+     * Read data from the current position
+     */
+    ssize_t read(void *buf, size_t count)
+    {
+        return ::read(m_fd, buf, count);
+    }
+
+    /**
+     * Write data at the current position, extending the file if needed
+     */
+    ssize_t write(const void *buf, size_t count)
+    {
+        return ::write(m_fd, buf, count);
+    }
+
+    /**
+     * Positional read, the current position is left unchanged
+     */
+    ssize_t read_at(uint64_t offset, void *buf, size_t count) const
+    {
+        return ::pread(m_fd, buf, count, static_cast<off_t>(offset));
+    }
+
+    /**
+     * Positional write, the current position is left unchanged
+     */
+    ssize_t write_at(uint64_t offset, const void *buf, size_t count)
+    {
+        return ::pwrite(m_fd, buf, count, static_cast<off_t>(offset));
+    }
+
+    void seek(uint64_t position)
+    {
+        ::lseek(m_fd, static_cast<off_t>(position), SEEK_SET);
+    }
+
+    uint64_t position() const
+    {
+        off_t position = ::lseek(m_fd, 0, SEEK_CUR);
+        return position < 0 ? 0 : static_cast<uint64_t>(position);
+    }
+
+    uint64_t size() const
+    {
+        struct stat st;
+        return ::fstat(m_fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Set-associative cache of image sectors with a fixed capacity
+// Storage is part of the object (no heap allocation), the sector size is chosen at runtime
+// and the number of lines is CapacityBytes / sector size, rounded down to whole power-of-two sets
+// Each set replaces lines with the CLOCK (second chance) policy
+template <size_t CapacityBytes, uint32_t Ways = 4>
+class SectorCache
+{
+private:
+    static constexpr uint32_t kMinSectorSize = 512;
+    static constexpr uint32_t kMaxLines = CapacityBytes / kMinSectorSize;
+    static constexpr uint32_t kInvalidSector = 0xffffffff;
+
+    std::array<uint8_t, CapacityBytes> m_data;           // Sector data, line i at i * m_sector_size
+    std::array<uint32_t, kMaxLines> m_tags;              // Sector held by each line (kInvalidSector if empty)
+    std::array<uint8_t, kMaxLines> m_referenced;         // CLOCK reference bit of each line
+    std::array<uint8_t, kMaxLines / Ways + 1> m_hands;   // CLOCK hand of each set
+    uint32_t m_sector_size = 0;
+    uint32_t m_set_mask = 0; // Number of sets - 1
+    bool m_enabled = false;
+
+    uint32_t setFromSector(uint32_t sector) const { return sector & m_set_mask; }
+
+    // Returns the line holding 'sector', or kMaxLines
+    uint32_t find(uint32_t sector) const
+    {
+        uint32_t first_line = setFromSector(sector) * Ways;
+        for (uint32_t way = 0; way < Ways; way++)
+        {
+            if (m_tags[first_line + way] == sector)
+            {
+                return first_line + way;
+            }
+        }
+        return kMaxLines;
+    }
+
+public:
+    // Whether at least one set of 'sector_size' sectors fits
+    static constexpr bool fits(uint32_t sector_size) { return sector_size >= kMinSectorSize && CapacityBytes / sector_size >= Ways; }
+
+    // Sizes the cache for sectors of 'sector_size' bytes and empties it
+    // Returns false (cache stays disabled) if not even one set fits
+    bool configure(uint32_t sector_size)
+    {
+        m_enabled = false;
+        if (!fits(sector_size))
+        {
+            return false;
+        }
+
+        m_sector_size = sector_size;
+        m_set_mask = std::bit_floor(static_cast<uint32_t>(CapacityBytes / sector_size / Ways)) - 1;
+        m_enabled = true;
+        invalidate();
+        return true;
+    }
+
+    bool enabled() const { return m_enabled; }
+    uint32_t lines() const { return m_enabled ? (m_set_mask + 1) * Ways : 0; }
+
+    bool contains(uint32_t sector) const { return m_enabled && find(sector) != kMaxLines; }
+
+    // Returns the cached data of 'sector' (and marks it recently used), or nullptr
+    const uint8_t *lookup(uint32_t sector)
+    {
+        if (!m_enabled)
+        {
+            return nullptr;
+        }
+        uint32_t line = find(sector);
+        if (line == kMaxLines)
+        {
+            return nullptr;
+        }
+        m_referenced[line] = 1;
+        return m_data.data() + line * m_sector_size;
+    }
+
+    // Stores 'sector', evicting the first line of its set not referenced since the hand last passed
+    void insert(uint32_t sector, const uint8_t *data)
+    {
+        if (!m_enabled)
+        {
+            return;
+        }
+
+        uint32_t line = find(sector);
+        if (line == kMaxLines)
+        {
+            uint32_t set = setFromSector(sector);
+            uint32_t first_line = set * Ways;
+            while (m_referenced[first_line + m_hands[set]])
+            {
+                m_referenced[first_line + m_hands[set]] = 0;
+                m_hands[set] = (m_hands[set] + 1) % Ways;
+            }
+            line = first_line + m_hands[set];
+            m_hands[set] = (m_hands[set] + 1) % Ways;
+            m_tags[line] = sector;
+        }
+
+        memcpy(m_data.data() + line * m_sector_size, data, m_sector_size);
+        m_referenced[line] = 1;
+    }
+
+    // Refreshes 'sector' with new data if it is cached (write-through)
+    void update(uint32_t sector, const uint8_t *data)
+    {
+        if (!m_enabled)
+        {
+            return;
+        }
+        uint32_t line = find(sector);
+        if (line != kMaxLines)
+        {
+            memcpy(m_data.data() + line * m_sector_size, data, m_sector_size);
+        }
+    }
+
+    // Drops 'sector' if it is cached
+    void invalidate(uint32_t sector)
+    {
+        if (!m_enabled)
+        {
+            return;
+        }
+        uint32_t line = find(sector);
+        if (line != kMaxLines)
+        {
+            m_tags[line] = kInvalidSector;
+            m_referenced[line] = 0;
+        }
+    }
+
+    // Drops everything
+    void invalidate()
+    {
+        m_tags.fill(kInvalidSector);
+        m_referenced.fill(0);
+        m_hands.fill(0);
+    }
+};
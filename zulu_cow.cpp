@@ -1,356 +1,3404 @@
 #include "zulu_cow.hpp"
 
 #include <cassert>
+#include <cstddef>
 #include <algorithm>
+#include <memory>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdexcept>
 
+// On-disk layout of the sidecar header, the bitmap follows at kBitmapHeaderSize
+struct CowBitmapHeader
+{
+    uint32_t magic;         // kBitmapMagic
+    uint32_t version;       // kBitmapVersion
+    uint32_t generation;    // Incremented each time a new bitmap is started
+    uint32_t group_size;    // Group size in sectors
+    uint32_t group_count;   // Number of groups (bits) in the bitmap
+    uint32_t block_size;    // SCSI block size in bytes
+    uint64_t image_size;    // Size of the original image in bytes
+    uint32_t flags;         // kBitmapFlag* describing the overlay layout
+    uint32_t checksum;      // Checksum of the fields above
+};
+
+static constexpr uint32_t kBitmapMagic = 0x574f435a; // "ZCOW"
+static constexpr uint32_t kBitmapVersion = 1;
+static constexpr uint32_t kBitmapHeaderSize = 512;   // Bitmap starts on its own sector
+static constexpr uint32_t kBitmapSectorSize = 512;   // Granularity of bitmap updates
+static constexpr uint32_t kBitmapFlagCompact = 1;    // Slot table follows the bitmap
+static constexpr uint32_t kBitmapFlagZero = 2;       // Zero bitmap follows the bitmap (and slot table)
+
+// FNV-1a, good enough to reject torn or foreign headers
+static uint32_t checksum32(const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+#if ZULU_COW_INSTRUMENTATION
+// Adds the time until the end of the scope to a latency histogram, and the file calls made
+// meanwhile to a call count histogram (if any)
+class CowInstrumentScope
+{
+private:
+    CowInstrumentation &m_counters;
+    std::array<uint64_t, CowInstrumentation::kLatencyBuckets> &m_latency;
+    std::array<uint64_t, CowInstrumentation::kCallBuckets> *m_calls;
+    uint64_t m_start_us;
+    uint64_t m_start_calls;
+
+    uint64_t calls() const { return m_counters.file_reads + m_counters.file_writes; }
+
+public:
+    CowInstrumentScope(CowInstrumentation &counters, std::array<uint64_t, CowInstrumentation::kLatencyBuckets> &latency,
+                       std::array<uint64_t, CowInstrumentation::kCallBuckets> *calls)
+        : m_counters(counters), m_latency(latency), m_calls(calls), m_start_us(ZULU_COW_TRACE_CLOCK_US()), m_start_calls(this->calls())
+    {
+    }
+
+    ~CowInstrumentScope()
+    {
+        uint64_t elapsed = ZULU_COW_TRACE_CLOCK_US() - m_start_us;
+        m_latency[std::min<size_t>(std::bit_width(elapsed), m_latency.size() - 1)]++;
+        if (m_calls != nullptr)
+        {
+            (*m_calls)[std::min<size_t>(calls() - m_start_calls, m_calls->size() - 1)]++;
+        }
+    }
+};
+#define COW_INSTRUMENT(counter) m_instrumentation.counter++
+#define COW_INSTRUMENT_SCOPE(latency, calls) CowInstrumentScope instrument_scope(m_instrumentation, m_instrumentation.latency, calls)
+#else
+#define COW_INSTRUMENT(counter)
+#define COW_INSTRUMENT_SCOPE(latency, calls)
+#endif
+
+// Holds the stripe locks of the groups of [from, to), or of all groups, for its scope (nothing without ZULU_COW_CONCURRENT)
+// Stripes are locked in increasing order, so calls locking several of them cannot deadlock
+template <uint32_t BlockSize>
+class BasicImageBackingStore<BlockSize>::GroupLock
+{
+#if ZULU_COW_CONCURRENT
+private:
+    BasicImageBackingStore &m_store;
+    uint64_t m_stripes = 0; // Bit i: stripe i is held
+
+    void lock()
+    {
+        for (uint32_t i = 0; i < kLockStripes; i++)
+        {
+            if (m_stripes & (uint64_t{1} << i))
+            {
+                m_store.m_stripe_locks[i].lock();
+            }
+        }
+    }
+
+public:
+    explicit GroupLock(BasicImageBackingStore &store) : m_store(store), m_stripes(~uint64_t{0} >> (64 - kLockStripes)) { lock(); }
+
+    GroupLock(BasicImageBackingStore &store, uint64_t from, uint64_t to) : m_store(store)
+    {
+        uint32_t first_group = store.groupFromOffset(from);
+        uint32_t last_group = to > from ? store.groupFromOffset(to - 1) : first_group;
+        if (last_group - first_group + 1 >= kLockStripes)
+        {
+            m_stripes = ~uint64_t{0} >> (64 - kLockStripes);
+        }
+        else
+        {
+            for (uint32_t group = first_group; group <= last_group; group++)
+            {
+                m_stripes |= uint64_t{1} << store.lockStripe(group);
+            }
+        }
+        lock();
+    }
+
+    ~GroupLock() { unlock(); }
+
+    // Releases the stripes before the end of the scope
+    void unlock()
+    {
+        for (uint32_t i = 0; i < kLockStripes; i++)
+        {
+            if (m_stripes & (uint64_t{1} << i))
+            {
+                m_store.m_stripe_locks[i].unlock();
+            }
+        }
+        m_stripes = 0;
+    }
+#else
+public:
+    explicit GroupLock(BasicImageBackingStore &) {}
+    GroupLock(BasicImageBackingStore &, uint64_t, uint64_t) {}
+    void unlock() {}
+#endif
+
+    GroupLock(const GroupLock &) = delete;
+    GroupLock &operator=(const GroupLock &) = delete;
+};
+
+// Holds 'lock' for the scope in concurrent builds
+#if ZULU_COW_CONCURRENT
+#define COW_LOCK(lock) std::lock_guard<ZULU_COW_MUTEX> cow_lock_guard(lock)
+#else
+#define COW_LOCK(lock)
+#endif
+
+// Positional I/O: a single call on backends with read_at/write_at (pread/pwrite), seek + read/write otherwise
+template <uint32_t BlockSize>
+template <typename File>
+ssize_t BasicImageBackingStore<BlockSize>::readAt(File &file, uint64_t offset, void *buf, size_t count)
+{
+    static_assert(!ZULU_COW_CONCURRENT || requires { file.read_at(offset, buf, count); }, "seek + read is not thread-safe");
+    COW_INSTRUMENT(file_reads);
+    if constexpr (requires { file.read_at(offset, buf, count); })
+    {
+        return file.read_at(offset, buf, count);
+    }
+    else
+    {
+        COW_INSTRUMENT(file_seeks);
+        file.seek(offset);
+        return file.read(buf, count);
+    }
+}
+
+template <uint32_t BlockSize>
+template <typename File>
+ssize_t BasicImageBackingStore<BlockSize>::writeAt(File &file, uint64_t offset, const void *buf, size_t count)
+{
+    static_assert(!ZULU_COW_CONCURRENT || requires { file.write_at(offset, buf, count); }, "seek + write is not thread-safe");
+    COW_INSTRUMENT(file_writes);
+    if constexpr (requires { file.write_at(offset, buf, count); })
+    {
+        return file.write_at(offset, buf, count);
+    }
+    else
+    {
+        COW_INSTRUMENT(file_seeks);
+        file.seek(offset);
+        return file.write(buf, count);
+    }
+}
+
+// Whether the backend gives direct access to file contents
+template <typename File>
+static constexpr bool kCanMap = requires(const File &file) { file.map(uint64_t{0}, size_t{0}); };
+
+// Direct pointer to 'count' bytes at 'offset' if the backend can map files, nullptr otherwise
+template <typename File>
+static const uint8_t *mapAt(File &file, uint64_t offset, size_t count)
+{
+    if constexpr (kCanMap<File>)
+    {
+        return file.map(offset, count);
+    }
+    else
+    {
+        return nullptr;
+    }
+}
+
+// Whether 'size' bytes are all zero
+// Tested 32 bytes at a time with a single branch per block, which compilers turn into vector ORs
+static bool isAllZero(const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (; size >= 32; size -= 32, bytes += 32)
+    {
+        uint64_t words[4];
+        memcpy(words, bytes, sizeof(words));
+        if ((words[0] | words[1] | words[2] | words[3]) != 0)
+        {
+            return false;
+        }
+    }
+    for (; size > 0; size--, bytes++)
+    {
+        if (*bytes != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Opens the original once and allocates buffer_count copy buffers of buffer_size bytes for the stores sharing it
+CowSharedBase::CowSharedBase(const char *orig_filename, uint32_t buffer_size, uint32_t buffer_count)
+{
+    if (!m_file.open(orig_filename, O_RDONLY))
+    {
+        throw std::runtime_error("Failed to open shared original file");
+    }
+    m_buffer_size = buffer_size;
+    m_buffer_count = std::max(1u, buffer_count);
+    m_buffer = new uint8_t[m_buffer_size * m_buffer_count];
+    assert(m_buffer != nullptr); // Check allocation succeeded
+}
+
+CowSharedBase::~CowSharedBase()
+{
+    assert(m_users == 0); // Stores must be destroyed before their base
+    delete[] m_buffer;
+}
+
 // Initializes copy-on-write store: bitmap_size (dirty tracking), buffer_size (I/O chunks), scsi_block_size (sector size)
-ImageBackingStore::ImageBackingStore(const char *orig_filename, const char *dirty_filename,
-                                     uint32_t bitmap_max_size, uint32_t buffer_size, uint32_t scsi_block_size)
+template <uint32_t BlockSize>
+BasicImageBackingStore<BlockSize>::BasicImageBackingStore(const char *orig_filename, const char *dirty_filename,
+                                                          uint32_t bitmap_max_size, uint32_t buffer_size, uint32_t scsi_block_size)
+    : BasicImageBackingStore(orig_filename, dirty_filename,
+                             ImageBackingStoreOptions{.bitmap_size = bitmap_max_size,
+                                                      .buffer_size = buffer_size,
+                                                      .scsi_block_size = scsi_block_size})
+{
+}
+
+// Initializes copy-on-write store, reloading the bitmap from options.bitmap_filename if it matches the image
+template <uint32_t BlockSize>
+BasicImageBackingStore<BlockSize>::BasicImageBackingStore(const char *orig_filename, const char *dirty_filename,
+                                                          const ImageBackingStoreOptions &options)
 {
+    uint64_t start_us = ZULU_COW_TRACE_CLOCK_US();
+    uint32_t bitmap_max_size = options.bitmap_size;
+    uint32_t scsi_block_size = options.scsi_block_size;
+
+    if (ZULU_COW_CONCURRENT &&
+        (options.read_ahead_sectors > 0 || options.write_back_size > 0 || options.split_groups > 0 || options.shared_base != nullptr))
+    {
+        throw std::runtime_error("Read-ahead, write-back, split groups and shared bases are not available in concurrent builds");
+    }
+    if (BlockSize != 0 && scsi_block_size != BlockSize)
+    {
+        throw std::runtime_error("SCSI block size differs from the one this store is specialized for");
+    }
     m_scsi_block_size = scsi_block_size;
+    m_scsi_block_shift = std::has_single_bit(scsi_block_size) ? std::countr_zero(scsi_block_size) : 0;
     m_current_position = 0;
-    m_buffer_size = buffer_size;
+    m_buffer_size = options.buffer_size;
+    m_bitmap_persistent = options.bitmap_filename != nullptr;
+    m_bitmap_flush_threshold = options.bitmap_flush_threshold;
+    m_compact_overlay = options.compact_overlay;
+    m_arena = static_cast<uint8_t *>(options.arena);
+    m_arena_size = options.arena_size;
+
+    // Open files with default size for mock
+    // A shared base is already open, and stays read-only as other stores read it too
+    m_shared_base = options.shared_base;
+    m_base_file = &m_fsfile_orig;
+    m_original_writable = options.writable_original && m_shared_base == nullptr;
+    if (m_shared_base != nullptr)
+    {
+        m_base_file = &m_shared_base->m_file;
+    }
+    else if (!m_fsfile_orig.open(orig_filename, m_original_writable ? O_RDWR : O_RDONLY))
+    {
+        releaseBuffers();
+        throw std::runtime_error("Failed to open original file");
+    }
+    if (!m_fsfile_dirty.open(dirty_filename, O_RDWR | O_CREAT))
+    {
+        releaseBuffers();
+        throw std::runtime_error("Failed to open dirty file");
+    }
+    if (m_bitmap_persistent && !m_fsfile_bitmap.open(options.bitmap_filename, O_RDWR | O_CREAT))
+    {
+        releaseBuffers();
+        throw std::runtime_error("Failed to open bitmap file");
+    }
+
+    // Calculate image size in sectors, an image without a whole sector has no group to track
+    uint64_t image_size_bytes = m_base_file->size();
+    if (image_size_bytes < scsi_block_size)
+    {
+        releaseBuffers();
+        throw std::runtime_error("Original file is smaller than a sector");
+    }
+    m_image_size_bytes = image_size_bytes;
+    uint32_t total_sectors = sectorFromOffset(image_size_bytes);
+
+    // Calculate optimal group size based on provided bitmap size
+    // We have bitmap_size * 8 bits available in our bitmap
+    uint32_t max_groups = bitmap_max_size * 8;
+
+    // Calculate group size - must be multiple of 512 sectors and fit within bitmap
+    m_cow_group_size_exact = ((total_sectors + max_groups - 1) / max_groups);
+    m_cow_group_size = m_cow_group_size_exact;
+
+    // Rounding up only lowers the group count, so the bitmap budget still holds
+    if (options.group_sizing == CowGroupSizing::PowerOfTwo)
+    {
+        m_cow_group_size = std::bit_ceil(m_cow_group_size_exact);
+    }
+    m_cow_group_size_bytes = m_cow_group_size * m_scsi_block_size;
+    m_group_offset_shift = std::has_single_bit(m_cow_group_size_bytes) ? std::countr_zero(m_cow_group_size_bytes) : 0;
+
+    // Calculate actual number of groups needed
+    m_cow_group_count = (total_sectors + m_cow_group_size - 1) / m_cow_group_size;
+
+    // This should never happen due to our group size calculation
+    assert(m_cow_group_count <= max_groups);
+
+    m_bitmap_size = (m_cow_group_count + 7) / 8;
+    m_bitmap_max_size = bitmap_max_size;
+
+    // Allocate and initialize bitmap using the provided bitmap_size
+    // (rounded up to whole words, padding bits stay clear)
+    uint32_t bitmap_words = (m_cow_group_count + 31) / 32;
+    m_cow_bitmap = allocate<uint32_t>(bitmap_words);
+    memset(m_cow_bitmap, 0, bitmap_words * sizeof(uint32_t));
+    if (options.zero_groups)
+    {
+        m_zero_bitmap = allocate<uint32_t>(bitmap_words);
+        memset(m_zero_bitmap, 0, bitmap_words * sizeof(uint32_t));
+    }
+
+    // Split groups, pointless when a group is a single sector
+    if (options.split_groups > 0 && m_cow_group_size > 1)
+    {
+        m_split_sectors = (m_cow_group_size + kSplitSubGroups - 1) / kSplitSubGroups;
+        m_split_group_capacity = options.split_groups;
+        m_split_groups = allocate<CowSplitGroup>(m_split_group_capacity);
+        m_split_bitmap = allocate<uint32_t>(bitmap_words);
+        memset(m_split_bitmap, 0, bitmap_words * sizeof(uint32_t));
+    }
+
+    // Allocate temporary buffer(s) for copy operations, each holding a whole number of sectors
+    // With a shared base the buffers of the base are used, double buffering only if it has two
+    if (m_shared_base != nullptr)
+    {
+        m_buffer_size = m_shared_base->m_buffer_size;
+        if (m_buffer_size < m_scsi_block_size)
+        {
+            releaseBuffers();
+            throw std::runtime_error("Shared copy buffers are smaller than a sector");
+        }
+    }
+    m_copy_chunk_sectors = std::max(1u, m_buffer_size / m_scsi_block_size);
+    m_copy_chunk_size = m_copy_chunk_sectors * m_scsi_block_size;
+    m_copy_buffer_count = options.double_buffer_copy ? 2 : 1;
+    if (m_shared_base != nullptr)
+    {
+        m_copy_buffer_count = std::min(m_copy_buffer_count, m_shared_base->m_buffer_count);
+        m_buffer = m_shared_base->m_buffer;
+        m_shared_base->m_users++;
+    }
+    else
+    {
+        m_buffer = allocate<uint8_t>(m_copy_chunk_size * m_copy_buffer_count * kLockStripes); // See copyBuffer()
+    }
+
+    // Allocate staging buffer merging partial group copies with the payload (one per lock stripe)
+    m_staging_buffer_size = options.staging_buffer_size;
+    if (m_staging_buffer_size > 0)
+    {
+        m_staging_buffer = allocate<uint8_t>(m_staging_buffer_size * kLockStripes);
+    }
+
+    // Write-back buffer gathering small adjacent writes
+    m_write_back_capacity = options.write_back_size;
+    m_write_back_delay_us = options.write_back_delay_us;
+    if (m_write_back_capacity > 0)
+    {
+        m_write_back = allocate<uint8_t>(m_write_back_capacity);
+    }
+
+    // Sector cache (stays disabled if the build has no room for it)
+    if (options.read_cache && ReadCache::fits(m_scsi_block_size))
+    {
+        m_read_cache = allocate<ReadCache>(1);
+        m_read_cache->configure(m_scsi_block_size);
+    }
+    m_read_cache_max_sectors = options.read_cache_max_sectors;
+    m_async_chunk_size = std::max(1u, options.async_chunk_sectors) * m_scsi_block_size;
+
+    // Read-ahead buffer
+    m_read_ahead_capacity = options.read_ahead_sectors * m_scsi_block_size;
+    if (m_read_ahead_capacity > 0)
+    {
+        m_read_ahead_buffer = allocate<uint8_t>(m_read_ahead_capacity);
+    }
+
+    // Compact overlay: no group has a slot yet, so nothing is allocated in the overlay file
+    if (m_compact_overlay)
+    {
+        m_overlay_slots = allocate<uint32_t>(m_cow_group_count);
+        std::fill(m_overlay_slots, m_overlay_slots + m_cow_group_count, kNoOverlaySlot);
+        m_free_slots = allocate<uint32_t>(m_cow_group_count);
+    }
+
+    if (options.base_layer_count > 0 && !loadBaseLayers(options.base_layers, options.base_layer_count))
+    {
+        releaseBuffers();
+        throw std::runtime_error("Failed to load base layers: missing, unreadable or not made for this image");
+    }
+
+    // Resume from the sidecar when its header checksum and geometry match this image, the overlay then
+    // already has the right size
+    m_bitmap_resumed = m_bitmap_persistent && loadBitmap();
+
+    if (!m_bitmap_resumed)
+    {
+        // Create overlay file at the same size as original (sparse)
+        // A compact overlay grows as groups are appended instead, and so does any overlay with fast_init:
+        // on FAT, extending a file allocates its whole cluster chain, which can take seconds on large images
+        if (!m_compact_overlay && !options.fast_init)
+        {
+            uint8_t zero = 0;
+            ssize_t written = writeAt(m_fsfile_dirty, image_size_bytes - 1, &zero, 1); // Create sparse file of correct size
+            if (written != 1)
+            {
+                releaseBuffers();
+                throw std::runtime_error("Failed to initialize dirty file: write operation failed");
+            }
+        }
+
+        // Start a new generation so a stale bitmap is never paired with this overlay
+        if (m_bitmap_persistent && !writeBitmapHeader())
+        {
+            releaseBuffers();
+            throw std::runtime_error("Failed to initialize bitmap file: write operation failed");
+        }
+    }
+
+    if (!options.fast_init)
+    {
+        dumpGeometry();
+    }
+
+    resetStats();
+    m_startup_us = ZULU_COW_TRACE_CLOCK_US() - start_us;
+}
+
+// Destructor: cleans up allocated memory
+template <uint32_t BlockSize>
+BasicImageBackingStore<BlockSize>::~BasicImageBackingStore()
+{
+    flush();
+    dumpstats();
+    releaseBuffers();
+}
+
+// Allocates 'count' T from the arena if the store has one, from the heap otherwise
+// Running out of arena fails construction (this is only called by the constructor)
+template <uint32_t BlockSize>
+template <typename T>
+T *BasicImageBackingStore<BlockSize>::allocate(size_t count)
+{
+    if (m_arena == nullptr)
+    {
+        T *data = new T[count];
+        assert(data != nullptr); // Check allocation succeeded
+        return data;
+    }
+
+    size_t start = (m_arena_used + alignof(T) - 1) / alignof(T) * alignof(T);
+    if (start + count * sizeof(T) > m_arena_size)
+    {
+        releaseBuffers();
+        throw std::runtime_error("Allocation arena too small for this image");
+    }
+    m_arena_used = start + count * sizeof(T);
+    T *data = reinterpret_cast<T *>(m_arena + start);
+    std::uninitialized_default_construct_n(data, count);
+    return data;
+}
+
+// Frees memory from allocate(), arena memory is only reclaimed when the store is gone
+template <uint32_t BlockSize>
+template <typename T>
+void BasicImageBackingStore<BlockSize>::release(T *data, size_t count)
+{
+    if (m_arena == nullptr)
+    {
+        delete[] data;
+    }
+    else if (data != nullptr)
+    {
+        std::destroy_n(data, count);
+    }
+}
+
+// Frees everything allocated by the constructor (also used when construction fails)
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::releaseBuffers()
+{
+    release(m_cow_bitmap);
+    release(m_zero_bitmap);
+    release(m_split_groups, m_split_group_capacity);
+    release(m_split_bitmap);
+    if (m_shared_base != nullptr)
+    {
+        if (m_buffer != nullptr)
+        {
+            m_shared_base->m_users--;
+        }
+    }
+    else
+    {
+        release(m_buffer);
+    }
+    release(m_staging_buffer);
+    release(m_write_back);
+    release(m_read_ahead_buffer);
+    release(m_read_cache, 1);
+    release(m_overlay_slots);
+    release(m_free_slots);
+    for (uint32_t i = 0; i < m_layer_count; i++)
+    {
+        release(m_layers[i].slots);
+    }
+    release(m_layers, m_layer_count);
+    release(m_group_owner);
+}
+
+template <uint32_t BlockSize>
+CowStats BasicImageBackingStore<BlockSize>::statistics() const
+{
+    return {m_bytes_read_original,
+            m_bytes_read_dirty,
+            m_bytes_written_dirty,
+            m_bytes_requested_read,
+            m_bytes_requested_write,
+            m_bytes_read_original_cow,
+            m_bitmap_flushes,
+            m_cow_copy_chunks,
+            m_staged_writes,
+            m_groups_written_full,
+            m_groups_written_partial_clean,
+            m_groups_written_partial_dirty,
+            m_read_cache_hits,
+            m_read_cache_misses,
+            m_read_ahead_bytes,
+            m_read_ahead_hits,
+            m_bytes_committed,
+            m_groups_written_zero,
+            m_bytes_read_zero,
+            m_groups_unmapped,
+            m_groups_split,
+            m_groups_prefilled,
+            m_writes_coalesced,
+            m_write_back_flushes,
+            m_startup_us};
+}
+
+template <uint32_t BlockSize>
+std::string BasicImageBackingStore<BlockSize>::stats() const
+{
+    CowStats counters = statistics();
+    std::string result = std::format("Over-read: {:.2f}%, Over-write: {:.2f}%", counters.overRead(), counters.overWrite());
+
+    // Rounded groups copy more on partial writes, show by how much they exceed the exact size
+    if (m_cow_group_size != m_cow_group_size_exact)
+    {
+        result += std::format(" (group {} sectors, exact {})", m_cow_group_size, m_cow_group_size_exact);
+    }
+    result += std::format(", Groups full/partial clean/partial dirty: {}/{}/{}",
+                          counters.groups_written_full, counters.groups_written_partial_clean, counters.groups_written_partial_dirty);
+    if (m_read_cache != nullptr)
+    {
+        result += std::format(", Cache hits/misses: {}/{}", counters.read_cache_hits, counters.read_cache_misses);
+    }
+    if (m_read_ahead_capacity > 0)
+    {
+        result += std::format(", Read-ahead prefetch/hits: {}/{}", counters.read_ahead_bytes, counters.read_ahead_hits);
+    }
+    if (m_zero_bitmap != nullptr)
+    {
+        result += std::format(", Zero groups written: {}", counters.groups_written_zero);
+    }
+    if (m_split_group_capacity > 0)
+    {
+        result += std::format(", Groups split: {}, Groups prefilled: {}", counters.groups_split, counters.groups_prefilled);
+    }
+    if (m_write_back_capacity > 0)
+    {
+        result += std::format(", Writes coalesced/flushes: {}/{}", counters.writes_coalesced, counters.write_back_flushes);
+    }
+    result += std::format(", Startup: {} us", counters.startup_us);
+    return result;
+}
+
+// Prints the geometry and the buffers of the store
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::dumpGeometry() const
+{
+    std::cout << std::format("Image size          {} bytes\n", m_image_size_bytes);
+    std::cout << std::format("m_bitmap_size       #groups = {}, real size = {} (requested: {})\n", m_cow_group_count, m_bitmap_size, m_bitmap_max_size);
+    std::cout << std::format("m_cow_group_size    {} sectors ({} bytes, exact {} sectors{})\n", m_cow_group_size, m_cow_group_size_bytes,
+                             m_cow_group_size_exact, m_group_offset_shift ? ", shift" : "");
+    std::cout << std::format("m_scsi_block_size   {} bytes{}\n", m_scsi_block_size, BlockSize != 0 ? " (fixed)" : "");
+    std::cout << std::format("m_buffer_size       {} bytes (copy chunk {} bytes x {}{})\n", m_buffer_size, m_copy_chunk_size, m_copy_buffer_count,
+                             m_shared_base != nullptr ? ", shared" : "");
+    if (m_compact_overlay)
+    {
+        std::cout << std::format("m_compact_overlay   {} slots, {} free\n", m_overlay_slot_count, m_free_slot_count + m_pending_slot_count);
+    }
+    if (m_split_group_capacity > 0)
+    {
+        std::cout << std::format("m_split_groups      {} groups of {} sub-groups ({} sectors each)\n", m_split_group_capacity, kSplitSubGroups,
+                                 m_split_sectors);
+    }
+    if (m_write_back_capacity > 0)
+    {
+        std::cout << std::format("m_write_back        {} bytes, written after {} us\n", m_write_back_capacity, m_write_back_delay_us);
+    }
+    if (m_read_cache != nullptr)
+    {
+        std::cout << std::format("m_read_cache        {} sectors\n", m_read_cache->lines());
+    }
+    if (m_layer_count > 0)
+    {
+        std::cout << std::format("m_layer_count       {} base layers\n", m_layer_count);
+    }
+    if (m_read_ahead_capacity > 0)
+    {
+        std::cout << std::format("m_read_ahead        {} bytes\n", m_read_ahead_capacity);
+    }
+    if (m_bitmap_persistent)
+    {
+        std::cout << std::format("m_bitmap_generation {} ({})\n", m_bitmap_generation, m_bitmap_resumed ? "resumed" : "new");
+    }
+}
+
+// Dumps detailed I/O statistics, the same snapshot as stats() formatted one counter per line
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::dumpstats() const
+{
+    CowStats counters = statistics();
+    std::cout << std::format("=== I/O Statistics ===\n");
+    std::cout << std::format("Bytes requested to read:  {}\n", counters.bytes_requested_read);
+    std::cout << std::format("Bytes read from dirty:    {}\n", counters.bytes_read_dirty);
+    std::cout << std::format("Bytes read from original: {}\n", counters.bytes_read_original);
+    std::cout << std::format("Bytes requested to write: {}\n", counters.bytes_requested_write);
+    std::cout << std::format("Bytes written to dirty:   {}\n", counters.bytes_written_dirty);
+    std::cout << std::format("Bytes read from original COW: {}\n", counters.bytes_read_original_cow);
+    std::cout << std::format("COW copy chunks:          {}\n", counters.cow_copy_chunks);
+    std::cout << std::format("Groups fully written:     {}\n", counters.groups_written_full);
+    std::cout << std::format("Groups partial, clean:    {}\n", counters.groups_written_partial_clean);
+    std::cout << std::format("Groups partial, dirty:    {}\n", counters.groups_written_partial_dirty);
+    if (counters.groups_unmapped > 0)
+    {
+        std::cout << std::format("Groups unmapped:          {}\n", counters.groups_unmapped);
+    }
+    if (m_split_group_capacity > 0)
+    {
+        std::cout << std::format("Groups split:             {}\n", counters.groups_split);
+        std::cout << std::format("Groups prefilled:         {}\n", counters.groups_prefilled);
+    }
+    if (m_write_back_capacity > 0)
+    {
+        std::cout << std::format("Writes coalesced:         {} ({} buffer flushes)\n", counters.writes_coalesced, counters.write_back_flushes);
+    }
+    if (m_zero_bitmap != nullptr)
+    {
+        std::cout << std::format("Groups written as zero:   {} ({} bytes read as zero)\n", counters.groups_written_zero, counters.bytes_read_zero);
+    }
+    if (m_read_cache != nullptr)
+    {
+        std::cout << std::format("Read cache hits/misses:   {}/{}\n", counters.read_cache_hits, counters.read_cache_misses);
+    }
+    if (m_read_ahead_capacity > 0)
+    {
+        std::cout << std::format("Read-ahead prefetch/hits: {}/{}\n", counters.read_ahead_bytes, counters.read_ahead_hits);
+    }
+    if (m_original_writable)
+    {
+        std::cout << std::format("Bytes committed:          {} ({} dirty groups left)\n", counters.bytes_committed, m_dirty_group_count);
+    }
+    if (m_staging_buffer_size > 0)
+    {
+        std::cout << std::format("Staged writes:            {}\n", counters.staged_writes);
+    }
+    if (m_bitmap_persistent)
+    {
+        std::cout << std::format("Bitmap flushes:           {}\n", counters.bitmap_flushes);
+    }
+    if (m_compact_overlay)
+    {
+        std::cout << std::format("Overlay size:             {} bytes ({} slots)\n",
+                                 static_cast<uint64_t>(m_overlay_slot_count) * m_cow_group_size_bytes, m_overlay_slot_count);
+    }
+    std::cout << std::format("Startup time:             {} us\n", counters.startup_us);
+    std::cout << std::format("======================\n");
+
+    if (counters.bytes_requested_read > 0)
+    {
+        std::cout << std::format(" Over-read  : {:.2f}%\n", counters.overRead());
+    }
+    if (counters.bytes_requested_write > 0)
+    {
+        std::cout << std::format(" Over-write : {:.2f}%\n", counters.overWrite());
+        if (m_cow_group_size != m_cow_group_size_exact)
+        {
+            std::cout << std::format(" Group size : {} sectors ({} exact, +{:.0f}% per partial group)\n", m_cow_group_size, m_cow_group_size_exact,
+                                     100.0 * (static_cast<double>(m_cow_group_size) / m_cow_group_size_exact - 1));
+        }
+    }
+}
+
+// Returns whether a group is stored in original or dirty file (or reads as zeros) by checking bitmap
+template <uint32_t BlockSize>
+typename BasicImageBackingStore<BlockSize>::eImageType BasicImageBackingStore<BlockSize>::getGroupImageType(uint32_t group)
+{
+    assert(group < m_cow_group_count);
+    if (!(dirtyWord(group / 32) & (1u << (group % 32))))
+    {
+        return IMG_TYPE_ORIG;
+    }
+    if (zeroWord(group / 32) & (1u << (group % 32)))
+    {
+        return IMG_TYPE_ZERO;
+    }
+    return (splitWord(group / 32) & (1u << (group % 32))) ? IMG_TYPE_SPLIT : IMG_TYPE_DIRTY;
+}
+
+// Sets group type in bitmap by setting or clearing the corresponding bit
+// The zero bit is set for ZERO and cleared for DIRTY or SPLIT, an ORIG group keeps it (ignored without the dirty bit)
+// The split bit is only set for SPLIT (see splitGroup), any other type releases the group's pool entry
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::setGroupImageType(uint32_t group, eImageType type)
+{
+    setGroupRangeImageType(group, group + 1, type);
+}
+
+// Sets groups [first_group, end_group) to the same type, a whole word at a time
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::setGroupRangeImageType(uint32_t first_group, uint32_t end_group, eImageType type)
+{
+    assert(first_group <= end_group && end_group <= m_cow_group_count);
+
+    while (first_group < end_group)
+    {
+        uint32_t word_index = first_group / 32;
+        uint32_t first_bit = first_group % 32;
+        uint32_t bit_count = std::min(32 - first_bit, end_group - first_group);
+
+        // Mask of bit_count bits starting at first_bit (bit_count can be 32)
+        uint32_t mask = (bit_count == 32) ? ~0u : (((1u << bit_count) - 1) << first_bit);
+        if (m_zero_bitmap != nullptr && type != IMG_TYPE_ORIG)
+        {
+            noteZeroBitmapChange(word_index, updateWord(m_zero_bitmap, word_index, mask, type == IMG_TYPE_ZERO));
+        }
+        if (m_split_bitmap != nullptr && type != IMG_TYPE_SPLIT)
+        {
+            releaseSplitGroups(word_index, updateWord(m_split_bitmap, word_index, mask, false));
+        }
+        else if (m_split_bitmap != nullptr)
+        {
+            updateWord(m_split_bitmap, word_index, mask, true);
+        }
+        noteBitmapChange(word_index, updateWord(m_cow_bitmap, word_index, mask, type != IMG_TYPE_ORIG));
+
+        first_group += bit_count;
+    }
+}
+
+// Records zero bitmap bits changed in RAM, for the next flush() when persistent
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::noteZeroBitmapChange(uint32_t word_index, uint32_t changed_bits)
+{
+    if (!m_bitmap_persistent || changed_bits == 0)
+    {
+        return;
+    }
+
+    COW_LOCK(m_state_lock);
+
+    if (m_zero_changed_first >= m_zero_changed_end)
+    {
+        m_zero_changed_first = word_index;
+        m_zero_changed_end = word_index + 1;
+    }
+    else
+    {
+        m_zero_changed_first = std::min(m_zero_changed_first, word_index);
+        m_zero_changed_end = std::max(m_zero_changed_end, word_index + 1);
+    }
+    m_bitmap_pending_groups += std::popcount(changed_bits);
+}
+
+// Records bitmap bits changed in RAM: keeps the dirty group count and, when persistent,
+// the range of words the next flush() has to write
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::noteBitmapChange(uint32_t word_index, uint32_t changed_bits)
+{
+    // Changed bits belong to groups locked by the caller, no other thread flips them back meanwhile
+    m_dirty_group_count += std::popcount(changed_bits & dirtyWord(word_index));
+    m_dirty_group_count -= std::popcount(changed_bits & ~dirtyWord(word_index));
+
+    if (!m_bitmap_persistent || changed_bits == 0)
+    {
+        return;
+    }
+
+    COW_LOCK(m_state_lock);
+
+    if (m_bitmap_changed_first >= m_bitmap_changed_end)
+    {
+        m_bitmap_changed_first = word_index;
+        m_bitmap_changed_end = word_index + 1;
+    }
+    else
+    {
+        m_bitmap_changed_first = std::min(m_bitmap_changed_first, word_index);
+        m_bitmap_changed_end = std::max(m_bitmap_changed_end, word_index + 1);
+    }
+    m_bitmap_pending_groups += std::popcount(changed_bits);
+}
+
+// Returns the first group in [group, limit) whose type differs from the type of 'group', or limit
+// Words are xored with the run type so that the first set bit is the end of the run
+// (the dirty and the effective zero and split bits are compared, so ZERO, SPLIT and DIRTY runs are told apart)
+template <uint32_t BlockSize>
+uint32_t BasicImageBackingStore<BlockSize>::findGroupRunEnd(uint32_t group, uint32_t limit)
+{
+    assert(group < limit && limit <= m_cow_group_count);
+
+    uint32_t word_index = group / 32;
+    uint32_t invert = (dirtyWord(word_index) & (1u << (group % 32))) ? ~0u : 0u;
+    uint32_t invert_zero = (zeroWord(word_index) & (1u << (group % 32))) ? ~0u : 0u;
+    uint32_t invert_split = (splitWord(word_index) & (1u << (group % 32))) ? ~0u : 0u;
+
+    // Ignore groups before the start of the run in the first word
+    uint32_t word = ((dirtyWord(word_index) ^ invert) | (zeroWord(word_index) ^ invert_zero) | (splitWord(word_index) ^ invert_split)) &
+                    (~0u << (group % 32));
+
+    while (word == 0)
+    {
+        word_index++;
+        if (word_index * 32 >= limit)
+        {
+            return limit;
+        }
+        word = (dirtyWord(word_index) ^ invert) | (zeroWord(word_index) ^ invert_zero) | (splitWord(word_index) ^ invert_split);
+    }
+
+    return std::min(limit, word_index * 32 + static_cast<uint32_t>(std::countr_zero(word)));
+}
+
+// Reads a sidecar header, fails if it is missing, foreign or corrupted
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::readSidecarHeader(FsFile &file, CowBitmapHeader &header)
+{
+    if (readAt(file, 0, &header, sizeof(header)) != sizeof(header))
+    {
+        return false;
+    }
+    return header.magic == kBitmapMagic && header.version == kBitmapVersion &&
+           header.checksum == checksum32(&header, offsetof(CowBitmapHeader, checksum));
+}
+
+// Whether a sidecar was written for the geometry of this image
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::sidecarMatchesImage(const CowBitmapHeader &header) const
+{
+    return header.group_size == m_cow_group_size && header.group_count == m_cow_group_count &&
+           header.block_size == m_scsi_block_size && header.image_size == m_image_size_bytes;
+}
+
+// Reads a bitmap stored at 'offset' in a sidecar
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::readSidecarWords(FsFile &file, uint32_t offset, uint32_t *bitmap)
+{
+    uint32_t bitmap_bytes = (m_cow_group_count + 31) / 32 * sizeof(uint32_t);
+    if (readAt(file, offset, bitmap, bitmap_bytes) != static_cast<ssize_t>(bitmap_bytes))
+    {
+        return false;
+    }
+
+    // Padding bits past the last group must stay clear for run scanning
+    if (m_cow_group_count % 32 != 0)
+    {
+        bitmap[m_cow_group_count / 32] &= (1u << (m_cow_group_count % 32)) - 1;
+    }
+    return true;
+}
+
+// Reads the bitmap of a sidecar and, for a compact overlay, its slot table
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::readSidecarBody(FsFile &file, uint32_t *bitmap, uint32_t *slots)
+{
+    if (!readSidecarWords(file, kBitmapHeaderSize, bitmap))
+    {
+        return false;
+    }
+
+    if (slots != nullptr)
+    {
+        uint32_t table_bytes = m_cow_group_count * sizeof(uint32_t);
+        if (readAt(file, slotTableOffset(), slots, table_bytes) != static_cast<ssize_t>(table_bytes))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loads the bitmap from the sidecar if its header matches the current image geometry
+// Returns false (bitmap left clear) if the sidecar is missing, foreign or corrupted
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::loadBitmap()
+{
+    CowBitmapHeader header;
+    if (!readSidecarHeader(m_fsfile_bitmap, header))
+    {
+        return false;
+    }
+
+    // Keep the generation so a new bitmap started over this one gets a higher number
+    m_bitmap_generation = header.generation;
+
+    uint32_t flags = (m_compact_overlay ? kBitmapFlagCompact : 0) | (m_zero_bitmap != nullptr ? kBitmapFlagZero : 0);
+    if (!sidecarMatchesImage(header) || header.flags != flags)
+    {
+        return false; // Bitmap describes another geometry or overlay layout
+    }
+
+    uint32_t bitmap_words = (m_cow_group_count + 31) / 32;
+    if (!readSidecarBody(m_fsfile_bitmap, m_cow_bitmap, m_overlay_slots) ||
+        (m_zero_bitmap != nullptr && !readSidecarWords(m_fsfile_bitmap, zeroBitmapOffset(m_compact_overlay), m_zero_bitmap)))
+    {
+        memset(m_cow_bitmap, 0, bitmap_words * sizeof(uint32_t));
+        if (m_zero_bitmap != nullptr)
+        {
+            memset(m_zero_bitmap, 0, bitmap_words * sizeof(uint32_t));
+        }
+        if (m_compact_overlay)
+        {
+            std::fill(m_overlay_slots, m_overlay_slots + m_cow_group_count, kNoOverlaySlot);
+        }
+        return false;
+    }
+
+    m_dirty_group_count = 0;
+    for (uint32_t word = 0; word < bitmap_words; word++)
+    {
+        m_dirty_group_count += std::popcount(m_cow_bitmap[word]);
+    }
+
+    if (m_compact_overlay)
+    {
+        rebuildFreeSlots();
+    }
+
+    return true;
+}
+
+// Recomputes the compact overlay size and its free slots from a loaded slot table: new slots are
+// appended after the highest one in use, the unused ones below it are free
+// A crash between the slot table and bitmap updates of a flush may leave an unmapped group dirty
+// without a slot, it is cleared (unmapped data reads back unspecified)
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::rebuildFreeSlots()
+{
+    m_overlay_slot_count = 0;
+    for (uint32_t group = 0; group < m_cow_group_count; group++)
+    {
+        if (m_overlay_slots[group] != kNoOverlaySlot)
+        {
+            m_overlay_slot_count = std::max(m_overlay_slot_count, m_overlay_slots[group] + 1);
+        }
+        else if (getGroupImageType(group) == IMG_TYPE_DIRTY)
+        {
+            setGroupImageType(group, IMG_TYPE_ORIG);
+        }
+    }
+
+    // m_free_slots first flags the slots in use, then is compacted in place into the list of the others
+    std::fill(m_free_slots, m_free_slots + m_overlay_slot_count, 0);
+    for (uint32_t group = 0; group < m_cow_group_count; group++)
+    {
+        if (m_overlay_slots[group] != kNoOverlaySlot)
+        {
+            m_free_slots[m_overlay_slots[group]] = 1;
+        }
+    }
+    m_free_slot_count = 0;
+    m_pending_slot_count = 0;
+    for (uint32_t slot = 0; slot < m_overlay_slot_count; slot++)
+    {
+        if (m_free_slots[slot] == 0)
+        {
+            m_free_slots[m_free_slot_count++] = slot;
+        }
+    }
+}
+
+// Opens the read-only base layers and records, for each group, the top-most layer owning it
+// Fails if there are too many layers, or one is unreadable or was made for another geometry
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::loadBaseLayers(const CowLayerFiles *layers, uint32_t layer_count)
+{
+    if (layer_count > kMaxBaseLayers)
+    {
+        return false;
+    }
+
+    m_layers = allocate<CowLayer>(layer_count);
+    m_layer_count = layer_count;
+    m_group_owner = allocate<uint8_t>(m_cow_group_count);
+    memset(m_group_owner, 0, m_cow_group_count); // Owned by the original
+
+    // Layer bitmaps are read into the bitmap of this store, which is cleared again when done
+    uint32_t bitmap_words = (m_cow_group_count + 31) / 32;
+    uint32_t *bitmap = m_cow_bitmap;
+
+    for (uint32_t i = 0; i < layer_count; i++)
+    {
+        FsFile sidecar;
+        CowBitmapHeader header;
+        if (!sidecar.open(layers[i].bitmap_filename, O_RDONLY) || !readSidecarHeader(sidecar, header) || !sidecarMatchesImage(header))
+        {
+            return false;
+        }
+
+        if (header.flags & kBitmapFlagCompact)
+        {
+            m_layers[i].slots = allocate<uint32_t>(m_cow_group_count);
+        }
+        if (!readSidecarBody(sidecar, bitmap, m_layers[i].slots))
+        {
+            return false;
+        }
+        if (!m_layers[i].data.open(layers[i].overlay_filename, O_RDONLY))
+        {
+            return false;
+        }
+
+        // Higher layers are loaded later and take ownership over lower ones
+        for (uint32_t word = 0; word < bitmap_words; word++)
+        {
+            for (uint32_t bits = bitmap[word]; bits != 0; bits &= bits - 1)
+            {
+                m_group_owner[word * 32 + std::countr_zero(bits)] = static_cast<uint8_t>(i + 1);
+            }
+        }
+
+        // ZERO groups of this layer are the ones it just took that also have their zero bit set
+        if (header.flags & kBitmapFlagZero)
+        {
+            if (!readSidecarWords(sidecar, zeroBitmapOffset(header.flags & kBitmapFlagCompact), bitmap))
+            {
+                return false;
+            }
+            for (uint32_t word = 0; word < bitmap_words; word++)
+            {
+                for (uint32_t bits = bitmap[word]; bits != 0; bits &= bits - 1)
+                {
+                    uint32_t group = word * 32 + std::countr_zero(bits);
+                    if (m_group_owner[group] == i + 1)
+                    {
+                        m_group_owner[group] = kZeroOwner;
+                    }
+                }
+            }
+        }
+    }
+
+    memset(bitmap, 0, bitmap_words * sizeof(uint32_t));
+    return true;
+}
+
+// Offset of the slot table in the sidecar, on the first sector after the bitmap
+template <uint32_t BlockSize>
+uint32_t BasicImageBackingStore<BlockSize>::slotTableOffset() const
+{
+    uint32_t bitmap_bytes = (m_cow_group_count + 31) / 32 * sizeof(uint32_t);
+    return kBitmapHeaderSize + (bitmap_bytes + kBitmapSectorSize - 1) / kBitmapSectorSize * kBitmapSectorSize;
+}
+
+// Offset of the zero bitmap in the sidecar, on the first sector after the bitmap or the slot table
+template <uint32_t BlockSize>
+uint32_t BasicImageBackingStore<BlockSize>::zeroBitmapOffset(bool compact) const
+{
+    if (!compact)
+    {
+        return slotTableOffset();
+    }
+    uint32_t table_bytes = m_cow_group_count * sizeof(uint32_t);
+    return slotTableOffset() + (table_bytes + kBitmapSectorSize - 1) / kBitmapSectorSize * kBitmapSectorSize;
+}
+
+// Writes bytes [from, to) of a 'size' bytes sidecar region, widened to whole sidecar sectors
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::writeSidecarSectors(uint32_t base, const void *data, uint32_t size, uint32_t from, uint32_t to)
+{
+    from = from / kBitmapSectorSize * kBitmapSectorSize;
+    to = std::min(size, (to + kBitmapSectorSize - 1) / kBitmapSectorSize * kBitmapSectorSize);
+
+    ssize_t written = writeAt(m_fsfile_bitmap, base + from, static_cast<const uint8_t *>(data) + from, to - from);
+    return written == static_cast<ssize_t>(to - from) && m_fsfile_bitmap.sync();
+}
+
+// Starts a new, empty bitmap generation in the sidecar
+// The cleared bitmap is made durable before the header that validates it
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::writeBitmapHeader()
+{
+    uint32_t bitmap_bytes = (m_cow_group_count + 31) / 32 * sizeof(uint32_t);
+    if (!writeSidecarSectors(kBitmapHeaderSize, m_cow_bitmap, bitmap_bytes, 0, bitmap_bytes))
+    {
+        return false;
+    }
+    if (m_compact_overlay)
+    {
+        uint32_t table_bytes = m_cow_group_count * sizeof(uint32_t);
+        if (!writeSidecarSectors(slotTableOffset(), m_overlay_slots, table_bytes, 0, table_bytes))
+        {
+            return false;
+        }
+    }
+    if (m_zero_bitmap != nullptr && !writeSidecarSectors(zeroBitmapOffset(m_compact_overlay), m_zero_bitmap, bitmap_bytes, 0, bitmap_bytes))
+    {
+        return false;
+    }
+
+    CowBitmapHeader header = {};
+    header.magic = kBitmapMagic;
+    header.version = kBitmapVersion;
+    header.generation = ++m_bitmap_generation;
+    header.group_size = m_cow_group_size;
+    header.group_count = m_cow_group_count;
+    header.block_size = m_scsi_block_size;
+    header.image_size = m_image_size_bytes;
+    header.flags = (m_compact_overlay ? kBitmapFlagCompact : 0) | (m_zero_bitmap != nullptr ? kBitmapFlagZero : 0);
+    header.checksum = checksum32(&header, offsetof(CowBitmapHeader, checksum));
+
+    if (writeAt(m_fsfile_bitmap, 0, &header, sizeof(header)) != sizeof(header) || !m_fsfile_bitmap.sync())
+    {
+        return false;
+    }
+
+    m_bitmap_changed_first = m_bitmap_changed_end = 0;
+    m_slots_changed_first = m_slots_changed_end = 0;
+    m_zero_changed_first = m_zero_changed_end = 0;
+    m_bitmap_pending_groups = 0;
+    return true;
+}
+
+// Syncs the overlay first, so that a group is never marked dirty on disk before its data is there,
+// then rewrites only the slot table and bitmap sectors that changed since the last flush
+// Changes stay pending when a write fails and are retried on next flush
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::flush()
+{
+    GroupLock lock(*this);
+    if (!flushWriteBack() || (m_bitmap_persistent && !settleSplitGroups()))
+    {
+        return false;
+    }
+
+    // Committed groups must be in the original before their bits are cleared on disk
+    if (!m_fsfile_dirty.sync() || (m_original_writable && !m_fsfile_orig.sync()))
+    {
+        return false;
+    }
+    if (!m_bitmap_persistent)
+    {
+        return true;
+    }
+
+    // Slots must be durable before the bits that make them visible
+    if (m_slots_changed_first < m_slots_changed_end)
+    {
+        if (!writeSidecarSectors(slotTableOffset(), m_overlay_slots, m_cow_group_count * sizeof(uint32_t),
+                                 m_slots_changed_first * sizeof(uint32_t), m_slots_changed_end * sizeof(uint32_t)))
+        {
+            return false;
+        }
+        m_slots_changed_first = m_slots_changed_end = 0;
+    }
+
+    // Zero bits are only read where the dirty bit is set: setting one must reach the disk before
+    // the dirty bit of a new ZERO group, and clearing one before a clean group gets written data
+    if (m_zero_changed_first < m_zero_changed_end)
+    {
+        if (!writeSidecarSectors(zeroBitmapOffset(m_compact_overlay), m_zero_bitmap, (m_cow_group_count + 31) / 32 * sizeof(uint32_t),
+                                 m_zero_changed_first * sizeof(uint32_t), m_zero_changed_end * sizeof(uint32_t)))
+        {
+            return false;
+        }
+        m_zero_changed_first = m_zero_changed_end = 0;
+    }
+
+    if (m_bitmap_changed_first < m_bitmap_changed_end)
+    {
+        if (!writeSidecarSectors(kBitmapHeaderSize, m_cow_bitmap, (m_cow_group_count + 31) / 32 * sizeof(uint32_t),
+                                 m_bitmap_changed_first * sizeof(uint32_t), m_bitmap_changed_end * sizeof(uint32_t)))
+        {
+            return false;
+        }
+        m_bitmap_changed_first = m_bitmap_changed_end = 0;
+        m_bitmap_flushes++;
+    }
+    m_bitmap_pending_groups = 0;
+
+    // Released slots are no longer mapped on disk either, new groups may take them
+    COW_LOCK(m_state_lock);
+    for (; m_pending_slot_count > 0; m_pending_slot_count--)
+    {
+        m_free_slots[m_free_slot_count++] = m_free_slots[m_cow_group_count - m_pending_slot_count];
+    }
+
+    return true;
+}
+
+// Gives an overlay slot to each group in [first_group, end_group) that has none yet
+// Slots released by unmap are taken first, then consecutive groups written together get consecutive
+// new slots, so they stay one overlay run
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::allocateOverlaySlots(uint32_t first_group, uint32_t end_group)
+{
+    if (!m_compact_overlay)
+    {
+        return;
+    }
+
+    COW_LOCK(m_state_lock);
+    for (uint32_t group = first_group; group < end_group; group++)
+    {
+        if (m_overlay_slots[group] != kNoOverlaySlot)
+        {
+            continue;
+        }
+        m_overlay_slots[group] = m_free_slot_count > 0 ? m_free_slots[--m_free_slot_count] : m_overlay_slot_count++;
+        noteSlotChange(group);
+    }
+}
+
+// Takes the overlay slots of [first_group, end_group) back, their groups no longer have overlay data
+// A persistent slot stays pending until flush() wrote the slot table and bitmap without it, so that
+// after a crash no group still mapped to it on disk reads the data of another one
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::releaseOverlaySlots(uint32_t first_group, uint32_t end_group)
+{
+    if (!m_compact_overlay)
+    {
+        return;
+    }
+
+    COW_LOCK(m_state_lock);
+    for (uint32_t group = first_group; group < end_group; group++)
+    {
+        uint32_t slot = m_overlay_slots[group];
+        if (slot == kNoOverlaySlot)
+        {
+            continue;
+        }
+        m_overlay_slots[group] = kNoOverlaySlot;
+        noteSlotChange(group);
+        if (m_bitmap_persistent)
+        {
+            m_pending_slot_count++;
+            m_free_slots[m_cow_group_count - m_pending_slot_count] = slot;
+        }
+        else
+        {
+            m_free_slots[m_free_slot_count++] = slot;
+        }
+    }
+}
+
+// Records a slot table entry changed in RAM, for the next flush() when persistent (m_state_lock held)
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::noteSlotChange(uint32_t group)
+{
+    if (!m_bitmap_persistent)
+    {
+        return;
+    }
+
+    if (m_slots_changed_first >= m_slots_changed_end)
+    {
+        m_slots_changed_first = group;
+        m_slots_changed_end = group + 1;
+    }
+    else
+    {
+        m_slots_changed_first = std::min(m_slots_changed_first, group);
+        m_slots_changed_end = std::max(m_slots_changed_end, group + 1);
+    }
+}
+
+// Returns the offset in an overlay file holding byte 'offset' of the image
+// slots is the slot table of a compact overlay, nullptr if the overlay mirrors image offsets
+template <uint32_t BlockSize>
+uint64_t BasicImageBackingStore<BlockSize>::layerOffset(const uint32_t *slots, uint64_t offset) const
+{
+    if (slots == nullptr)
+    {
+        return offset;
+    }
+
+    uint32_t group = groupFromOffset(offset);
+    assert(slots[group] != kNoOverlaySlot);
+    return static_cast<uint64_t>(slots[group]) * m_cow_group_size_bytes + (offset - offsetFromGroup(group));
+}
+
+// Returns the end of the range starting at 'from' that is contiguous in an overlay file, at most 'to'
+template <uint32_t BlockSize>
+uint64_t BasicImageBackingStore<BlockSize>::layerRunEnd(const uint32_t *slots, uint64_t from, uint64_t to) const
+{
+    if (slots == nullptr)
+    {
+        return to;
+    }
+
+    uint32_t group = groupFromOffset(from);
+    uint32_t last_group = groupFromOffset(to - 1);
+    while (group < last_group && slots[group + 1] == slots[group] + 1)
+    {
+        group++;
+    }
+    return std::min(to, offsetFromGroup(group + 1));
+}
+
+// Reads image bytes [from, from + count) from an overlay file, one contiguous run at a time
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::readMapped(FsFile &file, const uint32_t *slots, uint64_t from, uint32_t count, void *buf)
+{
+    uint8_t *buffer_ptr = static_cast<uint8_t *>(buf);
+    uint64_t to = from + count;
+    ssize_t total_bytes_read = 0;
+
+    while (from < to)
+    {
+        uint32_t run_bytes = static_cast<uint32_t>(layerRunEnd(slots, from, to) - from);
+        ssize_t bytes_read = readAt(file, layerOffset(slots, from), buffer_ptr, run_bytes);
+        if (bytes_read < 0)
+        {
+            return bytes_read;
+        }
+        total_bytes_read += bytes_read;
+        if (static_cast<uint32_t>(bytes_read) != run_bytes)
+        {
+            break; // Short read, report what we got
+        }
+        buffer_ptr += bytes_read;
+        from += run_bytes;
+    }
+
+    return total_bytes_read;
+}
+
+// Reads image bytes [from, from + count) from the overlay
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::readOverlay(uint64_t from, uint32_t count, void *buf)
+{
+    return readMapped(m_fsfile_dirty, m_overlay_slots, from, count, buf);
+}
+
+// Reads image bytes [from, from + count) from what lies below the overlay:
+// the original, or for each group the top-most base layer owning it
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::readBase(uint64_t from, uint32_t count, void *buf)
+{
+    if (m_group_owner == nullptr)
+    {
+        return readAt(*m_base_file, from, buf, count);
+    }
+
+    uint8_t *buffer_ptr = static_cast<uint8_t *>(buf);
+    uint64_t to = from + count;
+    uint32_t last_group = groupFromOffset(to - 1);
+    ssize_t total_bytes_read = 0;
+
+    while (from < to)
+    {
+        // Extend the run while groups have the same owner
+        uint32_t group = groupFromOffset(from);
+        uint8_t owner = m_group_owner[group];
+        while (group < last_group && m_group_owner[group + 1] == owner)
+        {
+            group++;
+        }
+        uint32_t run_bytes = static_cast<uint32_t>(std::min(to, offsetFromGroup(group + 1)) - from);
+
+        ssize_t bytes_read;
+        if (owner == kZeroOwner)
+        {
+            memset(buffer_ptr, 0, run_bytes);
+            bytes_read = run_bytes;
+        }
+        else if (owner == 0)
+        {
+            bytes_read = readAt(*m_base_file, from, buffer_ptr, run_bytes);
+        }
+        else
+        {
+            bytes_read = readMapped(m_layers[owner - 1].data, m_layers[owner - 1].slots, from, run_bytes, buffer_ptr);
+        }
+        if (bytes_read < 0)
+        {
+            return bytes_read;
+        }
+        total_bytes_read += bytes_read;
+        if (static_cast<uint32_t>(bytes_read) != run_bytes)
+        {
+            break; // Short read, report what we got
+        }
+        buffer_ptr += bytes_read;
+        from += run_bytes;
+    }
+
+    return total_bytes_read;
+}
+
+// Reads image bytes [from, from + count) of a single group that a partial write keeps:
+// zeros for a ZERO group (or sub-groups of a split group that was ZERO), otherwise what lies below the overlay
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::readPreserved(uint64_t from, uint32_t count, void *buf)
+{
+    uint32_t group = groupFromOffset(from);
+    eImageType type = getGroupImageType(group);
+    if (type == IMG_TYPE_ZERO || (type == IMG_TYPE_SPLIT && findSplitGroup(group)->zero_below))
+    {
+        memset(buf, 0, count);
+        return count;
+    }
+    return readBase(from, count, buf);
+}
+
+// Writes image bytes [from, from + count) to the overlay, one contiguous overlay run at a time
+// Groups in the range must already have a slot in compact mode
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::writeOverlay(uint64_t from, uint32_t count, const void *buf)
+{
+    const uint8_t *buffer_ptr = static_cast<const uint8_t *>(buf);
+    uint64_t to = from + count;
+    ssize_t total_bytes_written = 0;
+
+    while (from < to)
+    {
+        uint32_t run_bytes = static_cast<uint32_t>(layerRunEnd(m_overlay_slots, from, to) - from);
+        ssize_t bytes_written = writeAt(m_fsfile_dirty, layerOffset(m_overlay_slots, from), buffer_ptr, run_bytes);
+        if (bytes_written < 0)
+        {
+            return bytes_written;
+        }
+        total_bytes_written += bytes_written;
+        if (static_cast<uint32_t>(bytes_written) != run_bytes)
+        {
+            break; // Short write, report what we got
+        }
+        buffer_ptr += bytes_written;
+        from += run_bytes;
+    }
+
+    return total_bytes_written;
+}
+
+// Reads from a single image type (original or dirty) for given byte range, through the read cache
+// Used for implementation the high-level read
+// Sector aligned requests are served from cached sectors, misses are read in runs and
+// cached if the request is small (repeatedly read metadata rather than streaming data)
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_read_single(uint64_t from, uint32_t count, void *buf)
+{
+    uint32_t first_sector = sectorFromOffset(from);
+    if (m_read_cache == nullptr || offsetFromSector(first_sector) != from || count % blockSize() != 0)
+    {
+        return readSingleSource(from, count, buf);
+    }
+
+    uint8_t *buffer_ptr = static_cast<uint8_t *>(buf);
+    uint32_t sector_count = count / blockSize();
+    bool fill = sector_count <= m_read_cache_max_sectors;
+
+    uint32_t i = 0;
+    while (i < sector_count)
+    {
+        uint32_t run_end = i + 1;
+        {
+            COW_LOCK(m_state_lock);
+            const uint8_t *cached = m_read_cache->lookup(first_sector + i);
+            if (cached != nullptr)
+            {
+                memcpy(buffer_ptr + i * blockSize(), cached, blockSize());
+                m_read_cache_hits++;
+                i++;
+                continue;
+            }
+
+            // Read the run of missing sectors at once
+            while (run_end < sector_count && !m_read_cache->contains(first_sector + run_end))
+            {
+                run_end++;
+            }
+        }
+        m_read_cache_misses += run_end - i;
+
+        uint32_t run_bytes = (run_end - i) * blockSize();
+        ssize_t bytes_read = readSingleSource(offsetFromSector(first_sector + i), run_bytes, buffer_ptr + i * blockSize());
+        if (bytes_read < 0)
+        {
+            return bytes_read;
+        }
+        if (static_cast<uint32_t>(bytes_read) != run_bytes)
+        {
+            return i * blockSize() + bytes_read; // Short read, nothing more to cache
+        }
+
+        if (fill)
+        {
+            COW_LOCK(m_state_lock);
+            for (uint32_t sector = i; sector < run_end; sector++)
+            {
+                m_read_cache->insert(first_sector + sector, buffer_ptr + sector * blockSize());
+            }
+        }
+        i = run_end;
+    }
+
+    return count;
+}
+
+// Keeps cached sectors in [from, to) equal to what was just written from 'buf'
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::updateReadCache(uint64_t from, uint64_t to, const void *buf)
+{
+    if (m_read_cache == nullptr)
+    {
+        return;
+    }
+
+    const uint8_t *buffer_ptr = static_cast<const uint8_t *>(buf);
+    uint32_t first_sector = sectorFromOffset(from);
+    uint32_t end_sector = sectorFromOffset(to - 1) + 1;
+    bool aligned = offsetFromSector(first_sector) == from && (to - from) % blockSize() == 0;
+
+    COW_LOCK(m_state_lock);
+    for (uint32_t sector = first_sector; sector < end_sector; sector++)
+    {
+        if (aligned)
+        {
+            m_read_cache->update(sector, buffer_ptr + (sector - first_sector) * blockSize());
+        }
+        else
+        {
+            m_read_cache->invalidate(sector); // Partially written sector
+        }
+    }
+}
+
+// Reads a byte range from the file its group type designates
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::readSingleSource(uint64_t from, uint32_t count, void *buf)
+{
+    eImageType type = getGroupImageType(groupFromOffset(from));
+    if (type == IMG_TYPE_ZERO)
+    {
+        m_bytes_read_zero += count;
+        memset(buf, 0, count);
+        return count;
+    }
+    if (type == IMG_TYPE_DIRTY)
+    {
+        // Read from overlay/dirty file, at same offset as original unless compact
+        m_bytes_read_dirty += count;
+        return readOverlay(from, count, buf);
+    }
+    if (type == IMG_TYPE_SPLIT)
+    {
+        return readSplit(from, count, buf);
+    }
+    // Read from original file (or the base layer owning the group)
+    m_bytes_read_original += count;
+    return readBase(from, count, buf);
+}
+
+/*
+    Reads across multiple groups, switching between original and dirty files as needed
+
+|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
+                           |                          |                          |                          |      Groups (3 sectors each)
+           DIRTY           |          CLEAN           |          CLEAN           |          DIRTY           |      Group state before write
+          [---------------------------------------------------------------------------------------]         |      Read 10 blocs, spanning 4 groups
+          [  DIRTY READ   ] [                      CLEAN READ                   ] [  DIRTY READ   ]|        |      Underlying chunks from alternating sources
+|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
+
+    Idea is we repeatedly create a "chunk" that extends from the current read position
+    to the next transition between original and dirty, or to the end of the read request
+*/
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::readChunks(uint64_t from, uint64_t to, void *buf)
+{
+    ssize_t total_bytes_read = 0;
+    uint8_t *buffer_ptr = static_cast<uint8_t *>(buf);
+    uint64_t current_offset = from;
+
+    // Groups past the end of the image are never scanned
+    uint32_t last_group = std::min(groupFromOffset(to - 1) + 1, m_cow_group_count);
+
+    while (current_offset < to)
+    {
+        // Find the end of the current chunk (either 'to' or where image type changes)
+        uint32_t current_group = groupFromOffset(current_offset);
+        uint32_t run_end = findGroupRunEnd(current_group, last_group);
+        uint64_t chunk_end = std::min(to, offsetFromGroup(run_end));
+
+        // Read this chunk using cow_read_single
+        ssize_t bytes_read = cow_read_single(current_offset, static_cast<uint32_t>(chunk_end - current_offset), buffer_ptr);
+        if (bytes_read <= 0)
+            break;
+
+        total_bytes_read += bytes_read;
+        buffer_ptr += bytes_read;
+        current_offset = chunk_end;
+    }
+
+    return total_bytes_read;
+}
+
+// Reads [from, to), using and refilling the read-ahead buffer
+// A read that starts where the previous one ended is sequential: the next read_ahead_sectors
+// are then prefetched once the buffer is used up, a non sequential read stops prefetching
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_read(uint64_t from, uint64_t to, void *buf)
+{
+    if (m_read_ahead_capacity == 0)
+    {
+        return readChunks(from, to, buf);
+    }
+
+    m_sequential_reads = (from == m_last_read_end) ? m_sequential_reads + 1 : 0;
+
+    uint8_t *buffer_ptr = static_cast<uint8_t *>(buf);
+    uint64_t offset = from;
+    uint64_t read_ahead_end = m_read_ahead_start + m_read_ahead_size;
+
+    // Serve the beginning of the request from prefetched data
+    if (from >= m_read_ahead_start && from < read_ahead_end)
+    {
+        uint32_t bytes = static_cast<uint32_t>(std::min(to, read_ahead_end) - from);
+        memcpy(buffer_ptr, m_read_ahead_buffer + (from - m_read_ahead_start), bytes);
+        m_read_ahead_hits += bytes;
+        buffer_ptr += bytes;
+        offset += bytes;
+    }
+
+    if (offset < to)
+    {
+        ssize_t bytes_read = readChunks(offset, to, buffer_ptr);
+        if (bytes_read < 0)
+        {
+            m_last_read_end = UINT64_MAX;
+            return (offset > from) ? static_cast<ssize_t>(offset - from) : bytes_read;
+        }
+        offset += bytes_read;
+    }
+    m_last_read_end = offset;
+
+    if (offset == to && m_sequential_reads > 0 && to >= read_ahead_end)
+    {
+        prefetchReadAhead(to);
+    }
+
+    return static_cast<ssize_t>(offset - from);
+}
+
+// Fills the read-ahead buffer with the data following 'from' (up to the end of the image)
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::prefetchReadAhead(uint64_t from)
+{
+    m_read_ahead_size = 0;
+
+    uint64_t to = std::min(from + m_read_ahead_capacity, m_image_size_bytes);
+    if (from >= to)
+    {
+        return;
+    }
+
+    ssize_t bytes_read = readChunks(from, to, m_read_ahead_buffer);
+    if (bytes_read > 0)
+    {
+        m_read_ahead_start = from;
+        m_read_ahead_size = static_cast<uint32_t>(bytes_read);
+        m_read_ahead_bytes += bytes_read;
+    }
+}
+
+// Wrapper for cow_read that uses current file position and updates it
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_read(void *buf, size_t count)
+{
+    ssize_t bytes_read = cow_read_at(m_current_position, buf, count);
+
+    // Update current position
+    if (bytes_read > 0)
+    {
+        set_position(m_current_position + bytes_read);
+    }
+
+    return bytes_read;
+}
+
+// Reads at 'offset', the position is left alone
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_read_at(uint64_t offset, void *buf, size_t count)
+{
+    COW_INSTRUMENT_SCOPE(read_latency, &m_instrumentation.read_calls);
+    trace(CowTraceOp::Read, offset, count);
+    m_bytes_requested_read += count;
+
+    GroupLock lock(*this, offset, offset + count);
+    ssize_t bytes_read = cow_read(offset, offset + count, buf);
+    if (bytes_read > 0)
+    {
+        patchWriteBack(offset, offset + bytes_read, buf);
+    }
+    return bytes_read;
+}
+
+// Size of the copy chunk starting at 'offset', chunks end on multiples of the chunk size in the image
+// so that only the first chunk of a copy can be unaligned
+template <uint32_t BlockSize>
+uint32_t BasicImageBackingStore<BlockSize>::copyChunkSize(uint64_t offset, uint64_t to_offset) const
+{
+    uint32_t sector = sectorFromOffset(offset);
+    uint64_t chunk_end = (static_cast<uint64_t>(sector) - sector % m_copy_chunk_sectors + m_copy_chunk_sectors) * blockSize();
+    return static_cast<uint32_t>(std::min(to_offset, chunk_end) - offset);
+}
+
+//  Helper function for cow_write
+//  Copies original data to overlay (dirty) file for a specific byte range
+//  Request never spans multiple groups
+//  With two copy buffers the read of the next chunk is issued before the write of the previous one,
+//  so a backend with DMA transfers can overlap them (a blocking backend just alternates)
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::performCopyOnWrite(uint64_t from_offset, uint64_t to_offset)
+{
+    COW_INSTRUMENT_SCOPE(copy_latency, nullptr);
+    // Verify both offsets are in the same group
+    assert(groupFromOffset(from_offset) == groupFromOffset(to_offset - 1));
+
+    uint32_t bytes_to_copy = static_cast<uint32_t>(to_offset - from_offset);
+
+    // The range is within a group, so it is contiguous in the overlay
+    uint64_t write_offset = overlayOffset(from_offset);
+
+    uint8_t *copy_buffer = copyBuffer(groupFromOffset(from_offset));
+    uint8_t *buffers[2] = {copy_buffer, copy_buffer + (m_copy_buffer_count - 1) * m_copy_chunk_size};
+    uint64_t read_offset = from_offset; // Next original byte to read
+    uint32_t pending_size = 0;          // Bytes read into buffers[pending] and not yet written
+    int pending = 0;
+
+    while (read_offset < to_offset || pending_size > 0)
+    {
+        int next = (m_copy_buffer_count == 2) ? 1 - pending : pending;
+        uint32_t chunk_size = 0;
+
+        if (read_offset < to_offset && (m_copy_buffer_count == 2 || pending_size == 0))
+        {
+            chunk_size = copyChunkSize(read_offset, to_offset);
+
+            ssize_t bytes_read = readPreserved(read_offset, chunk_size, buffers[next]);
+            if (bytes_read < 0)
+            {
+                return bytes_read; // Return read error immediately
+            }
+            if (static_cast<uint32_t>(bytes_read) != chunk_size)
+            {
+                return -1; // Unexpected partial read
+            }
+            m_bytes_read_original_cow += chunk_size;
+            m_cow_copy_chunks++;
+            read_offset += chunk_size;
+        }
+
+        if (pending_size > 0)
+        {
+            ssize_t bytes_written = writeAt(m_fsfile_dirty, write_offset, buffers[pending], pending_size);
+            if (bytes_written < 0)
+            {
+                return bytes_written; // Return write error immediately
+            }
+            if (static_cast<uint32_t>(bytes_written) != pending_size)
+            {
+                return -1; // Unexpected partial write
+            }
+            m_bytes_written_dirty += pending_size;
+            write_offset += pending_size;
+        }
+
+        pending = next;
+        pending_size = chunk_size;
+    }
+
+    return bytes_to_copy; // Return total bytes copied
+}
+
+/*
+    Writes data performing copy-on-write for unmodified portions at begining and end
+
+|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
+                  |                          |                          |                          |      Groups (3 sectors each)
+  CLEAN           |          CLEAN           |          CLEAN           |          CLEAN           |      Group state before write
+                  |                  [---------------------------------------------------]         |      Write 6 blocs, spanning 3 groups
+                  |[ COPY...COPY...] [ WRITE...WRITE...WRITE...WRITE...WRITE...WRITE...  ] [ COPY ]|      Actions taken (1), (2), (3)
+  CLEAN           |          DIRTY           |          DIRTY           |          DIRTY           |      Group market dirty after write (4)
+|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
+
+    Implementation follows the above pattern:
+    - (1) Handle first group: if clean and write doesn't start at group beginning, copy original data
+    - (2) Write the main data to dirty file
+    - (3) Handle last group: if clean and write doesn't end at group end, copy original data
+    - (4) Mark all affected groups as dirty
+
+    When the whole range from the start of (1) to the end of (3) fits in the staging buffer,
+    (1), (2) and (3) are assembled there and issued as a single overlay write instead. A longer
+    write stages each edge group that fits with its part of the payload and writes the middle directly
+
+    Each affected group is counted as fully overwritten, partial-and-clean or partial-and-dirty.
+    Only the first and last groups can be partial, when none is the write goes straight to the overlay
+    A ZERO group partially overwritten is copied like a clean one, with zeros as its original data
+
+    With zero groups enabled, an all-zero payload covering whole groups only marks them ZERO
+
+    Without 'preserve' the range is a piece of a larger write whose edges were already preserved
+    (see cow_writev), so neither classification nor copies are done
+*/
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_write(uint64_t from, uint64_t to, const void *buf, bool preserve)
+{
+    if (m_zero_bitmap != nullptr)
+    {
+        uint32_t first_full = groupFromOffset(from);
+        if (offsetFromGroup(first_full) != from)
+        {
+            first_full++;
+        }
+        uint32_t end_full = (to >= m_image_size_bytes) ? m_cow_group_count : groupFromOffset(to);
+        if (first_full < end_full && isAllZero(buf, to - from))
+        {
+            return writeZeroGroups(from, to, buf, first_full, end_full, preserve);
+        }
+    }
+
+    // Prefetched data overlapping the write is stale
+    if (m_read_ahead_size > 0 && from < m_read_ahead_start + m_read_ahead_size && to > m_read_ahead_start)
+    {
+        m_read_ahead_size = 0;
+    }
+
+    uint32_t first_group = groupFromOffset(from);
+    uint32_t last_group = groupFromOffset(to - 1); // Last byte affected
+
+    // Original data to preserve: [head_start, from) in the first group and [to, tail_end) in the last one
+    uint64_t head_start = from;
+    uint64_t tail_end = to;
+    if (preserve)
+    {
+        classifyWrite(from, to, head_start, tail_end);
+    }
+    else
+    {
+        allocateOverlaySlots(first_group, last_group + 1);
+    }
+
+    ssize_t bytes_written;
+    if (head_start == from && tail_end == to)
+    {
+        // Fast path: no original data to preserve, not even a COW check
+        bytes_written = writeOverlay(from, static_cast<uint32_t>(to - from), buf);
+        if (bytes_written <= 0)
+        {
+            return bytes_written;
+        }
+        m_bytes_written_dirty += bytes_written;
+    }
+    else if (tail_end - head_start <= m_staging_buffer_size && overlayRunEnd(head_start, tail_end) == tail_end)
+    {
+        bytes_written = writeStaged(head_start, from, to, tail_end, buf);
+        if (bytes_written < 0)
+        {
+            return bytes_written;
+        }
+    }
+    else
+    {
+        bytes_written = writeWithCopyOnWrite(head_start, from, to, tail_end, buf);
+        if (bytes_written <= 0)
+        {
+            return bytes_written;
+        }
+    }
+
+    // Mark all affected groups (or sub-groups of split groups) as dirty
+    markWritten(head_start, tail_end);
+    updateReadCache(from, from + bytes_written, buf);
+
+    return bytes_written;
+}
+
+// Allocates the overlay slots of [from, to), counts its groups by kind and returns the range
+// [head_start, tail_end) the write must cover to preserve the original data around it
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::classifyWrite(uint64_t from, uint64_t to, uint64_t &head_start, uint64_t &tail_end)
+{
+    uint32_t first_group = groupFromOffset(from);
+    uint32_t last_group = groupFromOffset(to - 1); // Last byte affected
+
+    // Compact overlay: groups written for the first time get their slots before any copy
+    allocateOverlaySlots(first_group, last_group + 1);
+
+    // Classify affected groups
+    uint64_t first_start = offsetFromGroup(first_group);
+    uint64_t last_end = groupEndOffset(last_group);
+    bool first_partial = from > first_start || (first_group == last_group && to < last_end);
+    bool last_partial = first_group != last_group && to < last_end;
+
+    m_groups_written_full += (last_group - first_group + 1) - (first_partial ? 1 : 0) - (last_partial ? 1 : 0);
+    eImageType first_type = first_partial ? countPartialGroup(first_group) : IMG_TYPE_DIRTY;
+    eImageType last_type = last_partial ? countPartialGroup(last_group) : IMG_TYPE_DIRTY;
+
+    // Clean partial groups become split groups while the pool lasts, so only the sub-groups at the
+    // edges of the write are copied
+    if (first_partial && (first_type == IMG_TYPE_ORIG || first_type == IMG_TYPE_ZERO) && splitGroup(first_group, first_type))
+    {
+        first_type = IMG_TYPE_SPLIT;
+    }
+    if (last_partial && (last_type == IMG_TYPE_ORIG || last_type == IMG_TYPE_ZERO) && splitGroup(last_group, last_type))
+    {
+        last_type = IMG_TYPE_SPLIT;
+    }
+    if (first_group == last_group)
+    {
+        last_type = first_type;
+    }
+
+    // Copy from the start of the group (clean), of the sub-group (split, when not valid yet) or nothing (dirty)
+    head_start = from;
+    if (first_type == IMG_TYPE_ORIG || first_type == IMG_TYPE_ZERO)
+    {
+        head_start = first_start;
+    }
+    else if (first_type == IMG_TYPE_SPLIT)
+    {
+        uint32_t sub_group = subGroupFromOffset(first_group, from);
+        if (!(findSplitGroup(first_group)->valid & (1u << sub_group)))
+        {
+            head_start = subGroupOffset(first_group, sub_group);
+        }
+    }
+
+    tail_end = to;
+    if (last_type == IMG_TYPE_ORIG || last_type == IMG_TYPE_ZERO)
+    {
+        tail_end = last_end;
+    }
+    else if (last_type == IMG_TYPE_SPLIT)
+    {
+        uint32_t sub_group = subGroupFromOffset(last_group, to - 1);
+        if (!(findSplitGroup(last_group)->valid & (1u << sub_group)))
+        {
+            tail_end = subGroupOffset(last_group, sub_group + 1);
+        }
+    }
+}
+
+// Writes an all-zero payload: groups [first_group, end_group), entirely covered, become ZERO without
+// any I/O, the partial groups on either side go through the normal write
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::writeZeroGroups(uint64_t from, uint64_t to, const void *buf, uint32_t first_group, uint32_t end_group,
+                                                           bool preserve)
+{
+    const uint8_t *buffer_ptr = static_cast<const uint8_t *>(buf);
+    uint64_t zero_start = offsetFromGroup(first_group);
+    uint64_t zero_end = groupEndOffset(end_group - 1);
+
+    if (from < zero_start)
+    {
+        ssize_t bytes_written = cow_write(from, zero_start, buffer_ptr, preserve);
+        if (bytes_written < 0 || static_cast<uint64_t>(bytes_written) != zero_start - from)
+        {
+            return bytes_written;
+        }
+    }
+
+    if (m_read_ahead_size > 0 && zero_start < m_read_ahead_start + m_read_ahead_size && zero_end > m_read_ahead_start)
+    {
+        m_read_ahead_size = 0;
+    }
+    setGroupRangeImageType(first_group, end_group, IMG_TYPE_ZERO);
+    m_groups_written_zero += end_group - first_group;
+    updateReadCache(zero_start, zero_end, buffer_ptr + (zero_start - from));
+
+    if (zero_end < to)
+    {
+        ssize_t bytes_written = cow_write(zero_end, to, buffer_ptr + (zero_end - from), preserve);
+        if (bytes_written < 0)
+        {
+            return bytes_written;
+        }
+        return static_cast<ssize_t>(zero_end - from) + bytes_written;
+    }
+    return static_cast<ssize_t>(to - from);
+}
+
+// Releases [from, to): groups entirely covered become ZERO (zero groups enabled) or revert to what
+// lies below the overlay, either way without any I/O
+// Partially covered groups are left alone, their unmapped sectors simply keep their data
+// (UNMAP lets them read back anything), so no copy-on-write is ever needed
+// Compact overlay slots are released for other groups to reuse, as FsFile cannot punch holes to shrink the file
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::unmap(uint64_t from, uint64_t to)
+{
+    uint32_t first_group = groupFromOffset(from);
+    if (offsetFromGroup(first_group) != from)
+    {
+        first_group++;
+    }
+    uint32_t end_group = (to >= m_image_size_bytes) ? m_cow_group_count : groupFromOffset(to);
+    if (first_group >= end_group)
+    {
+        return static_cast<ssize_t>(to - from);
+    }
+
+    uint64_t unmap_start = offsetFromGroup(first_group);
+    uint64_t unmap_end = groupEndOffset(end_group - 1);
+    if (m_read_ahead_size > 0 && unmap_start < m_read_ahead_start + m_read_ahead_size && unmap_end > m_read_ahead_start)
+    {
+        m_read_ahead_size = 0;
+    }
+    setGroupRangeImageType(first_group, end_group, m_zero_bitmap != nullptr ? IMG_TYPE_ZERO : IMG_TYPE_ORIG);
+    releaseOverlaySlots(first_group, end_group);
+    m_groups_unmapped += end_group - first_group;
+
+    // Cached sectors of these groups may no longer be what a read returns
+    if (m_read_cache != nullptr)
+    {
+        COW_LOCK(m_state_lock);
+        for (uint32_t sector = sectorFromOffset(unmap_start); sector < sectorFromOffset(unmap_end); sector++)
+        {
+            m_read_cache->invalidate(sector);
+        }
+    }
+
+    return static_cast<ssize_t>(to - from);
+}
+
+// Batches bitmap updates: flushes once enough groups changed, a failed flush is retried next time
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::flushIfPending()
+{
+    if (m_bitmap_persistent && m_bitmap_pending_groups >= m_bitmap_flush_threshold)
+    {
+        flush();
+    }
+}
+
+// Reverts to the original image: clears the bitmap and, when persistent, starts a new bitmap
+// generation on disk. The overlay file itself is neither scanned nor truncated, compact overlay
+// slots are kept and reused when their groups are written again
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::discard()
+{
+    GroupLock lock(*this);
+    m_write_back_size = 0;
+    if (m_split_bitmap != nullptr)
+    {
+        memset(m_split_bitmap, 0, (m_cow_group_count + 31) / 32 * sizeof(uint32_t));
+        std::fill(m_split_groups, m_split_groups + m_split_group_capacity, CowSplitGroup{});
+    }
+    memset(m_cow_bitmap, 0, (m_cow_group_count + 31) / 32 * sizeof(uint32_t));
+    if (m_zero_bitmap != nullptr)
+    {
+        memset(m_zero_bitmap, 0, (m_cow_group_count + 31) / 32 * sizeof(uint32_t));
+    }
+    m_dirty_group_count = 0;
+    m_commit_cursor = 0;
+
+    // Cached data may come from the overlay
+    if (m_read_cache != nullptr)
+    {
+        m_read_cache->invalidate();
+    }
+    m_read_ahead_size = 0;
+
+    if (m_bitmap_persistent)
+    {
+        return writeBitmapHeader();
+    }
+    return true;
+}
+
+// Collects small pieces (sidecar words) into the export buffer and hands it to the sink when full
+struct CowExportWriter
+{
+    CowExportSink sink;
+    void *context;
+    uint8_t *buffer;
+    uint32_t size;
+    uint32_t used = 0;
+    uint64_t total = 0;
+
+    bool put(const void *data, uint32_t count)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        while (count > 0)
+        {
+            uint32_t chunk = std::min(count, size - used);
+            memcpy(buffer + used, bytes, chunk);
+            used += chunk;
+            bytes += chunk;
+            count -= chunk;
+            if (used == size && !drain())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool putWord(uint32_t word) { return put(&word, sizeof(word)); }
+
+    bool pad(uint32_t to_position)
+    {
+        static constexpr uint8_t kZeros[64] = {};
+        while (total + used < to_position)
+        {
+            if (!put(kZeros, static_cast<uint32_t>(std::min<uint64_t>(sizeof(kZeros), to_position - total - used))))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool drain()
+    {
+        if (used > 0 && !sink(context, buffer, used))
+        {
+            return false;
+        }
+        total += used;
+        used = 0;
+        return true;
+    }
+};
+
+template <uint32_t BlockSize>
+uint32_t BasicImageBackingStore<BlockSize>::deltaSidecarSize() const
+{
+    return zeroBitmapOffset(true) + (slotTableOffset() - kBitmapHeaderSize); // Zero bitmap is padded like the bitmap
+}
+
+/*
+    Streams the image without holding more than one buffer of it: runs of groups in the same state
+    are read through readSingleSource (bypassing the read cache, which an export would only flush)
+    A Delta export describes each group against the original file: groups the overlay or a base layer
+    changed are set in the bitmap, zeros go to the zero bitmap, the others get the next slot and
+    their data follows the sidecar in group order
+*/
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::exportImage(CowExportFormat format, CowExportSink sink, void *context, void *buffer, uint32_t buffer_size)
+{
+    GroupLock lock(*this);
+    if (!flushWriteBack())
+    {
+        return -1;
+    }
+    if (buffer == nullptr)
+    {
+        buffer = m_buffer;
+        buffer_size = m_buffer_size;
+    }
+    if (buffer_size == 0)
+    {
+        return -1;
+    }
+    CowExportWriter writer{sink, context, static_cast<uint8_t *>(buffer), buffer_size};
+
+    // Where a group comes from, relative to the original file
+    auto changed = [this](uint32_t group) {
+        return getGroupImageType(group) != IMG_TYPE_ORIG || (m_group_owner != nullptr && m_group_owner[group] != 0);
+    };
+    auto zero = [this](uint32_t group) {
+        eImageType type = getGroupImageType(group);
+        return type == IMG_TYPE_ZERO || (type == IMG_TYPE_ORIG && m_group_owner != nullptr && m_group_owner[group] == kZeroOwner);
+    };
+
+    if (format == CowExportFormat::Delta)
+    {
+        CowBitmapHeader header = {};
+        header.magic = kBitmapMagic;
+        header.version = kBitmapVersion;
+        header.generation = 1;
+        header.group_size = m_cow_group_size;
+        header.group_count = m_cow_group_count;
+        header.block_size = m_scsi_block_size;
+        header.image_size = m_image_size_bytes;
+        header.flags = kBitmapFlagCompact | kBitmapFlagZero;
+        header.checksum = checksum32(&header, offsetof(CowBitmapHeader, checksum));
+        if (!writer.put(&header, sizeof(header)) || !writer.pad(kBitmapHeaderSize))
+        {
+            return -1;
+        }
+
+        uint32_t bitmap_words = (m_cow_group_count + 31) / 32;
+        for (uint32_t word = 0; word < bitmap_words; word++)
+        {
+            uint32_t bits = 0;
+            for (uint32_t group = word * 32; group < std::min(m_cow_group_count, word * 32 + 32); group++)
+            {
+                bits |= changed(group) ? 1u << (group % 32) : 0;
+            }
+            if (!writer.putWord(bits))
+            {
+                return -1;
+            }
+        }
+        if (!writer.pad(slotTableOffset()))
+        {
+            return -1;
+        }
+
+        uint32_t slot = 0;
+        for (uint32_t group = 0; group < m_cow_group_count; group++)
+        {
+            bool has_data = changed(group) && !zero(group);
+            if (!writer.putWord(has_data ? slot++ : kNoOverlaySlot))
+            {
+                return -1;
+            }
+        }
+        if (!writer.pad(zeroBitmapOffset(true)))
+        {
+            return -1;
+        }
+
+        for (uint32_t word = 0; word < bitmap_words; word++)
+        {
+            uint32_t bits = 0;
+            for (uint32_t group = word * 32; group < std::min(m_cow_group_count, word * 32 + 32); group++)
+            {
+                bits |= zero(group) ? 1u << (group % 32) : 0;
+            }
+            if (!writer.putWord(bits))
+            {
+                return -1;
+            }
+        }
+        if (!writer.pad(deltaSidecarSize()) || !writer.drain())
+        {
+            return -1;
+        }
+    }
+
+    uint32_t group = 0;
+    while (group < m_cow_group_count)
+    {
+        // Full exports stream every run, Delta ones only runs of groups with data
+        uint32_t run_end = findGroupRunEnd(group, m_cow_group_count);
+        if (format == CowExportFormat::Delta)
+        {
+            bool has_data = changed(group) && !zero(group);
+            run_end = group + 1;
+            while (run_end < m_cow_group_count && (changed(run_end) && !zero(run_end)) == has_data)
+            {
+                run_end++;
+            }
+            if (!has_data)
+            {
+                group = run_end;
+                continue;
+            }
+        }
+
+        // A Delta run can mix overlay and base layer groups, each read stays within one group state
+        uint64_t to = groupEndOffset(run_end - 1);
+        for (uint64_t from = offsetFromGroup(group); from < to;)
+        {
+            uint64_t state_end = offsetFromGroup(findGroupRunEnd(groupFromOffset(from), run_end));
+            uint32_t chunk = static_cast<uint32_t>(std::min<uint64_t>(buffer_size, std::min(to, state_end) - from));
+            if (readSingleSource(from, chunk, buffer) != static_cast<ssize_t>(chunk) || !sink(context, buffer, chunk))
+            {
+                return -1;
+            }
+            writer.total += chunk;
+            from += chunk;
+        }
+        group = run_end;
+    }
+
+    return static_cast<ssize_t>(writer.total);
+}
+
+// Copies one dirty group from the overlay into the original, chunk by chunk through the copy buffer
+// A ZERO group is committed by writing zeros
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::commitGroup(uint32_t group)
+{
+    uint64_t offset = offsetFromGroup(group);
+    uint64_t group_end = groupEndOffset(group);
+    eImageType type = getGroupImageType(group);
+    CowSplitGroup *split = (type == IMG_TYPE_SPLIT) ? findSplitGroup(group) : nullptr;
+    bool zero = type == IMG_TYPE_ZERO;
+    if (zero)
+    {
+        memset(m_buffer, 0, m_copy_chunk_size);
+    }
+
+    while (offset < group_end)
+    {
+        // Sub-groups of a split group that are not valid already are the original, or zeros
+        uint64_t run_end = group_end;
+        if (split != nullptr)
+        {
+            bool valid;
+            run_end = splitRunEnd(*split, offset, group_end, valid);
+            if (!valid && !split->zero_below)
+            {
+                offset = run_end;
+                continue;
+            }
+            zero = !valid;
+            if (zero)
+            {
+                memset(m_buffer, 0, m_copy_chunk_size);
+            }
+        }
+        uint32_t chunk_size = copyChunkSize(offset, run_end);
+
+        ssize_t bytes_read = zero ? chunk_size : readOverlay(offset, chunk_size, m_buffer);
+        if (bytes_read < 0 || static_cast<uint32_t>(bytes_read) != chunk_size)
+        {
+            return bytes_read < 0 ? bytes_read : -1; // Read error or unexpected partial read
+        }
+
+        ssize_t bytes_written = writeAt(m_fsfile_orig, offset, m_buffer, chunk_size);
+        if (bytes_written < 0 || static_cast<uint32_t>(bytes_written) != chunk_size)
+        {
+            return bytes_written < 0 ? bytes_written : -1; // Write error or unexpected partial write
+        }
+        m_bytes_committed += chunk_size;
+
+        offset += chunk_size;
+    }
+
+    return static_cast<ssize_t>(group_end - offsetFromGroup(group));
+}
+
+/*
+    Folds the overlay back into the original, at most max_groups dirty groups per call
+
+    The commit cursor walks the bitmap (skipping clean runs a word at a time) and wraps around,
+    so groups written again behind the cursor are picked up by a later call.
+    A committed group holds the same data in both files, so clearing its bit right after the
+    copy keeps cow_read/cow_write correct between calls, and the read caches stay valid.
+    Returns the number of groups committed, 0 once no dirty group is left, or a negative error
+*/
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::commitStep(uint32_t max_groups)
+{
+    if (!m_original_writable || m_layer_count > 0)
+    {
+        return -1; // Original was opened read-only, or base layers would shadow committed data
+    }
+
+    GroupLock lock(*this);
+    uint32_t committed = 0;
+    while (committed < max_groups && m_dirty_group_count > 0)
+    {
+        if (m_commit_cursor >= m_cow_group_count)
+        {
+            m_commit_cursor = 0;
+        }
+
+        // Skip to the next dirty group
+        if (getGroupImageType(m_commit_cursor) == IMG_TYPE_ORIG)
+        {
+            m_commit_cursor = findGroupRunEnd(m_commit_cursor, m_cow_group_count);
+            continue;
+        }
+
+        ssize_t result = commitGroup(m_commit_cursor);
+        if (result < 0)
+        {
+            return result;
+        }
+        setGroupImageType(m_commit_cursor, IMG_TYPE_ORIG);
+        m_commit_cursor++;
+        committed++;
+    }
+    lock.unlock();
+
+    flushIfPending();
+
+    return committed;
+}
+
+// Counts a partially overwritten group as clean (ZERO included, it needs a copy too) or dirty (SPLIT
+// included, it already has overlay data), and returns its type
+template <uint32_t BlockSize>
+typename BasicImageBackingStore<BlockSize>::eImageType BasicImageBackingStore<BlockSize>::countPartialGroup(uint32_t group)
+{
+    eImageType type = getGroupImageType(group);
+    if (type == IMG_TYPE_ORIG || type == IMG_TYPE_ZERO)
+    {
+        m_groups_written_partial_clean++;
+    }
+    else
+    {
+        m_groups_written_partial_dirty++;
+    }
+    return type;
+}
+
+// Returns the pool entry of a SPLIT group (a linear search, the pool is small)
+template <uint32_t BlockSize>
+typename BasicImageBackingStore<BlockSize>::CowSplitGroup *BasicImageBackingStore<BlockSize>::findSplitGroup(uint32_t group)
+{
+    for (uint32_t i = 0; i < m_split_group_capacity; i++)
+    {
+        if (m_split_groups[i].group == group)
+        {
+            return &m_split_groups[i];
+        }
+    }
+    assert(false); // Split bit set without an entry
+    return nullptr;
+}
+
+// Turns a clean (ORIG or ZERO) group into a SPLIT group with no valid sub-group yet
+// Returns false when the pool is exhausted, the group is then copied whole as before
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::splitGroup(uint32_t group, eImageType type)
+{
+    for (uint32_t i = 0; i < m_split_group_capacity; i++)
+    {
+        if (m_split_groups[i].group == kNoSplitGroup)
+        {
+            m_split_groups[i] = {group, 0, type == IMG_TYPE_ZERO};
+            setGroupImageType(group, IMG_TYPE_SPLIT);
+            m_groups_split++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Frees the pool entries of the groups whose split bits were just cleared in a bitmap word
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::releaseSplitGroups(uint32_t word_index, uint32_t released_bits)
+{
+    while (released_bits != 0)
+    {
+        uint32_t group = word_index * 32 + std::countr_zero(released_bits);
+        *findSplitGroup(group) = CowSplitGroup{};
+        released_bits &= released_bits - 1;
+    }
+}
+
+// Marks [from, to) as holding overlay data: groups become DIRTY, except SPLIT groups only partly in
+// the range, which get the sub-groups the range touches marked valid (a write never leaves a
+// touched sub-group partially valid, see classifyWrite) and become DIRTY once all of them are
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::markWritten(uint64_t from, uint64_t to)
+{
+    uint32_t first_group = groupFromOffset(from);
+    uint32_t last_group = groupFromOffset(to - 1);
+    uint32_t dirty_first = first_group;
+    uint32_t dirty_end = last_group + 1;
+
+    for (uint32_t group : {first_group, last_group})
+    {
+        uint64_t group_start = offsetFromGroup(group);
+        uint64_t group_end = groupEndOffset(group);
+        if (getGroupImageType(group) != IMG_TYPE_SPLIT || (from <= group_start && to >= group_end))
+        {
+            continue;
+        }
+
+        CowSplitGroup *split = findSplitGroup(group);
+        uint32_t first_sub = subGroupFromOffset(group, std::max(from, group_start));
+        uint32_t end_sub = subGroupFromOffset(group, std::min(to, group_end) - 1) + 1;
+        uint32_t sub_count = subGroupFromOffset(group, group_end - 1) + 1;
+        split->valid |= (end_sub - first_sub == 32) ? ~0u : ((1u << (end_sub - first_sub)) - 1) << first_sub;
+        if (split->valid == ((sub_count == 32) ? ~0u : (1u << sub_count) - 1))
+        {
+            continue; // Whole group valid, DIRTY like the others
+        }
+
+        if (group == first_group)
+        {
+            dirty_first = first_group + 1;
+        }
+        if (group == last_group)
+        {
+            dirty_end = last_group;
+        }
+        if (first_group == last_group)
+        {
+            break;
+        }
+    }
+
+    if (dirty_first < dirty_end)
+    {
+        setGroupRangeImageType(dirty_first, dirty_end, IMG_TYPE_DIRTY);
+    }
+}
+
+// End of the run of sub-groups of a split group starting at 'from' that are all valid or all not, within 'to'
+template <uint32_t BlockSize>
+uint64_t BasicImageBackingStore<BlockSize>::splitRunEnd(const CowSplitGroup &split, uint64_t from, uint64_t to, bool &valid) const
+{
+    uint32_t sub_group = subGroupFromOffset(split.group, from);
+    valid = split.valid & (1u << sub_group);
+    uint32_t bits = (valid ? ~split.valid : split.valid) & ((sub_group == 31) ? 0u : ~0u << (sub_group + 1));
+    uint32_t end_sub = bits != 0 ? std::countr_zero(bits) : kSplitSubGroups;
+    return std::min(to, subGroupOffset(split.group, end_sub));
+}
+
+// Reads [from, from + count) over a run of SPLIT groups: valid sub-groups from the overlay, the others
+// from below the overlay (or zeros)
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::readSplit(uint64_t from, uint32_t count, void *buf)
+{
+    uint8_t *buffer_ptr = static_cast<uint8_t *>(buf);
+    uint64_t to = from + count;
+    ssize_t total_bytes_read = 0;
+
+    while (from < to)
+    {
+        uint32_t group = groupFromOffset(from);
+        const CowSplitGroup &split = *findSplitGroup(group);
+        bool valid;
+        uint32_t run_bytes = static_cast<uint32_t>(splitRunEnd(split, from, std::min(to, groupEndOffset(group)), valid) - from);
+
+        ssize_t bytes_read;
+        if (valid)
+        {
+            m_bytes_read_dirty += run_bytes;
+            bytes_read = readOverlay(from, run_bytes, buffer_ptr);
+        }
+        else if (split.zero_below)
+        {
+            m_bytes_read_zero += run_bytes;
+            memset(buffer_ptr, 0, run_bytes);
+            bytes_read = run_bytes;
+        }
+        else
+        {
+            m_bytes_read_original += run_bytes;
+            bytes_read = readBase(from, run_bytes, buffer_ptr);
+        }
+        if (bytes_read < 0)
+        {
+            return total_bytes_read > 0 ? total_bytes_read : bytes_read;
+        }
+        total_bytes_read += bytes_read;
+        if (static_cast<uint32_t>(bytes_read) != run_bytes)
+        {
+            break;
+        }
+        buffer_ptr += run_bytes;
+        from += run_bytes;
+    }
+    return total_bytes_read;
+}
+
+// Completes the copy-on-write of a split group: its sub-groups not written yet are copied from below
+// the overlay, then it becomes a plain DIRTY group and its pool entry is free again
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::settleSplitGroup(CowSplitGroup &split)
+{
+    uint32_t group = split.group;
+    uint64_t offset = offsetFromGroup(group);
+    uint64_t group_end = groupEndOffset(group);
+    while (offset < group_end)
+    {
+        bool valid;
+        uint64_t run_end = splitRunEnd(split, offset, group_end, valid);
+        if (!valid)
+        {
+            ssize_t cow_result = performCopyOnWrite(offset, run_end);
+            if (cow_result < 0)
+            {
+                return cow_result;
+            }
+        }
+        offset = run_end;
+    }
+    setGroupImageType(group, IMG_TYPE_DIRTY);
+    m_groups_prefilled++;
+    return 0;
+}
+
+// Settles every split group, as plain DIRTY groups are all the sidecar can describe (called before
+// the bitmap is persisted)
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::settleSplitGroups()
+{
+    for (uint32_t i = 0; i < m_split_group_capacity; i++)
+    {
+        if (m_split_groups[i].group != kNoSplitGroup && settleSplitGroup(m_split_groups[i]) < 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Number of split groups waiting for prefillStep()
+template <uint32_t BlockSize>
+uint32_t BasicImageBackingStore<BlockSize>::splitGroupCount() const
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < m_split_group_capacity; i++)
+    {
+        count += m_split_groups[i].group != kNoSplitGroup;
+    }
+    return count;
+}
+
+/*
+    Background prefill: settles up to max_groups split groups
+
+    A partial write into a clean group only copies the rest of the sub-groups it touches, the rest
+    of the group is left to this idle-time task, and reads of it go below the overlay meanwhile.
+    Settling frees pool entries, so later partial writes can be split rather than copied whole.
+    Returns the number of groups settled, 0 once none is left, or a negative error
+*/
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::prefillStep(uint32_t max_groups)
+{
+    uint32_t settled = 0;
+    for (uint32_t i = 0; i < m_split_group_capacity && settled < max_groups; i++)
+    {
+        if (m_split_groups[i].group == kNoSplitGroup)
+        {
+            continue;
+        }
+        ssize_t result = settleSplitGroup(m_split_groups[i]);
+        if (result < 0)
+        {
+            return result;
+        }
+        settled++;
+    }
+
+    flushIfPending();
+
+    return settled;
+}
+
+// Writes the payload to the overlay and preserves the original data around it (steps (1) to (3))
+// An edge group whose preserved range fits in the staging buffer is assembled there with its part of
+// the payload and written at once, otherwise its original data is copied separately. The fully covered
+// groups in between are written straight from the payload
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::writeWithCopyOnWrite(uint64_t head_start, uint64_t from, uint64_t to, uint64_t tail_end,
+                                                                const void *buf)
+{
+    const uint8_t *payload = static_cast<const uint8_t *>(buf);
+    uint64_t middle_from = from; // Payload left for the direct write
+    uint64_t middle_to = to;
+    bool copy_head = false;
+    bool copy_tail = tail_end > to;
+
+    // Handle first group - copy-on-write if needed and write doesn't start at group beginning
+    if (from > head_start)
+    {
+        // Ending the write in the first group also leaves its tail to this piece
+        uint64_t piece_end = std::min(groupEndOffset(groupFromOffset(head_start)), to);
+        uint64_t piece_tail = piece_end == to ? tail_end : piece_end;
+        if (piece_tail - head_start <= m_staging_buffer_size)
+        {
+            ssize_t staged_result = writeStaged(head_start, from, piece_end, piece_tail, payload);
+            if (staged_result < 0)
+            {
+                return staged_result; // Return staged write error immediately
+            }
+            middle_from = piece_end;
+            copy_tail = copy_tail && piece_tail != tail_end;
+        }
+        else
+        {
+            copy_head = true;
+        }
+    }
+
+    // Handle last group - copy-on-write if needed and write doesn't end at group end
+    if (copy_tail)
+    {
+        uint64_t piece_start = std::max(offsetFromGroup(groupFromOffset(tail_end - 1)), middle_from);
+        if (tail_end - piece_start <= m_staging_buffer_size)
+        {
+            ssize_t staged_result = writeStaged(piece_start, piece_start, to, tail_end, payload + (piece_start - from));
+            if (staged_result < 0)
+            {
+                return staged_result; // Return staged write error immediately
+            }
+            middle_to = piece_start;
+            copy_tail = false;
+        }
+    }
+
+    if (copy_head)
+    {
+        // Need to preserve data before the write
+        ssize_t cow_result = performCopyOnWrite(head_start, from);
+        if (cow_result < 0)
+        {
+            return cow_result; // Return COW error immediately
+        }
+    }
+
+    // Handle copy in the dirty file
+    if (middle_to > middle_from)
+    {
+        uint32_t middle_size = static_cast<uint32_t>(middle_to - middle_from);
+        ssize_t bytes_written = writeOverlay(middle_from, middle_size, payload + (middle_from - from));
+        if (bytes_written < 0 || static_cast<uint32_t>(bytes_written) != middle_size)
+        {
+            return bytes_written < 0 ? bytes_written : -1; // Write error or unexpected partial write
+        }
+        m_bytes_written_dirty += middle_size;
+    }
+
+    if (copy_tail)
+    {
+        // Need to preserve data after the write
+        ssize_t cow_result = performCopyOnWrite(to, tail_end);
+        if (cow_result < 0)
+        {
+            return cow_result; // Return COW error immediately
+        }
+    }
+
+    return to - from;
+}
+
+// Writes [head_start, tail_end) with a single overlay write: the original data before 'from'
+// and after 'to' is read into the staging buffer on both sides of the payload
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::writeStaged(uint64_t head_start, uint64_t from, uint64_t to, uint64_t tail_end,
+                                                       const void *buf)
+{
+    uint8_t *staging_buffer = stagingBuffer(groupFromOffset(head_start));
+    uint32_t head_size = static_cast<uint32_t>(from - head_start);
+    uint32_t count = static_cast<uint32_t>(to - from);
+    uint32_t tail_size = static_cast<uint32_t>(tail_end - to);
+
+    if (head_size > 0)
+    {
+        ssize_t bytes_read = readPreserved(head_start, head_size, staging_buffer);
+        if (bytes_read < 0 || static_cast<uint32_t>(bytes_read) != head_size)
+        {
+            return bytes_read < 0 ? bytes_read : -1; // Read error or unexpected partial read
+        }
+        m_bytes_read_original_cow += head_size;
+    }
+
+    memcpy(staging_buffer + head_size, buf, count);
+
+    if (tail_size > 0)
+    {
+        ssize_t bytes_read = readPreserved(to, tail_size, staging_buffer + head_size + count);
+        if (bytes_read < 0 || static_cast<uint32_t>(bytes_read) != tail_size)
+        {
+            return bytes_read < 0 ? bytes_read : -1; // Read error or unexpected partial read
+        }
+        m_bytes_read_original_cow += tail_size;
+    }
 
-    // Open files with default size for mock
-    m_fsfile_orig.open(orig_filename, O_RDONLY);
-    m_fsfile_dirty.open(dirty_filename, O_RDWR | O_CREAT);
+    uint32_t total_size = head_size + count + tail_size;
+    ssize_t bytes_written = writeOverlay(head_start, total_size, staging_buffer);
+    if (bytes_written < 0 || static_cast<uint32_t>(bytes_written) != total_size)
+    {
+        return bytes_written < 0 ? bytes_written : -1; // Write error or unexpected partial write
+    }
+    m_bytes_written_dirty += total_size;
+    m_staged_writes++;
 
-    // Calculate image size in sectors
-    uint64_t image_size_bytes = m_fsfile_orig.size();
-    uint32_t total_sectors = image_size_bytes / scsi_block_size;
+    return count;
+}
 
-    // Create overlay file at the same size as original (sparse)
-    m_fsfile_dirty.seek(image_size_bytes - 1);
-    uint8_t zero = 0;
-    ssize_t written = m_fsfile_dirty.write(&zero, 1); // Create sparse file of correct size
-    if (written != 1)
+// Reads each segment straight into its buffer
+// Returns the bytes read, stopping after a short segment, or an error if the first one fails
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_readv(const CowIoSegment *segments, uint32_t segment_count)
+{
+    ssize_t total_bytes_read = 0;
+    for (uint32_t i = 0; i < segment_count; i++)
     {
-        throw std::runtime_error("Failed to initialize dirty file: write operation failed");
+        uint64_t from = offsetFromSector(segments[i].lba);
+        trace(CowTraceOp::Read, from, segments[i].count);
+        m_bytes_requested_read += segments[i].count;
+
+        GroupLock lock(*this, from, from + segments[i].count);
+        ssize_t bytes_read = cow_read(from, from + segments[i].count, segments[i].buf);
+        if (bytes_read < 0)
+        {
+            return total_bytes_read > 0 ? total_bytes_read : bytes_read;
+        }
+        patchWriteBack(from, from + bytes_read, segments[i].buf);
+        total_bytes_read += bytes_read;
+        set_position(from + bytes_read);
+        if (static_cast<uint32_t>(bytes_read) != segments[i].count)
+        {
+            break;
+        }
     }
+    return total_bytes_read;
+}
 
-    // Calculate optimal group size based on provided bitmap size
-    // We have bitmap_size * 8 bits available in our bitmap
-    uint32_t max_groups = bitmap_max_size * 8;
+/*
+    Writes each segment straight from its buffer
 
-    // Calculate group size - must be multiple of 512 sectors and fit within bitmap
-    m_cow_group_size = ((total_sectors + max_groups - 1) / max_groups);
-    m_cow_group_size_bytes = m_cow_group_size * m_scsi_block_size;
+    Segments following each other on disk (typically a ring buffer that wraps) form one run: the
+    original data around the run is preserved once, before its segments are written without any
+    copy-on-write. Written one by one, a group split between two segments would get its tail
+    copied only to be overwritten by the next segment.
+    Returns the bytes written, stopping after a short segment, or an error if the first one fails
+*/
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_writev(const CowIoSegment *segments, uint32_t segment_count)
+{
+    if (!flushWriteBack())
+    {
+        return -1;
+    }
 
-    // Calculate actual number of groups needed
-    m_cow_group_count = (total_sectors + m_cow_group_size - 1) / m_cow_group_size;
+    ssize_t total_bytes_written = 0;
+    uint32_t i = 0;
+    while (i < segment_count)
+    {
+        // Find the run of contiguous segments starting at i
+        uint64_t run_from = offsetFromSector(segments[i].lba);
+        uint64_t run_to = run_from + segments[i].count;
+        uint32_t run_end = i + 1;
+        while (run_end < segment_count && offsetFromSector(segments[run_end].lba) == run_to)
+        {
+            run_to += segments[run_end].count;
+            run_end++;
+        }
 
-    // This should never happen due to our group size calculation
-    assert(m_cow_group_count <= max_groups);
+        GroupLock lock(*this, run_from, run_to);
+        bool preserve = run_end == i + 1;
+        if (!preserve)
+        {
+            ssize_t result = preserveRunEdges(run_from, run_to);
+            if (result < 0)
+            {
+                return total_bytes_written > 0 ? total_bytes_written : result;
+            }
+        }
 
-    m_bitmap_size = (m_cow_group_count + 7) / 8;
+        for (; i < run_end; i++)
+        {
+            uint64_t from = offsetFromSector(segments[i].lba);
+            trace(CowTraceOp::Write, from, segments[i].count);
+            m_bytes_requested_write += segments[i].count;
 
-    // Allocate and initialize bitmap using the provided bitmap_size
-    m_cow_bitmap = new uint8_t[m_bitmap_size];
-    assert(m_cow_bitmap != nullptr); // Check allocation succeeded
-    memset(m_cow_bitmap, 0, m_bitmap_size);
+            ssize_t bytes_written = cow_write(from, from + segments[i].count, segments[i].buf, preserve);
+            if (bytes_written < 0)
+            {
+                return total_bytes_written > 0 ? total_bytes_written : bytes_written;
+            }
+            total_bytes_written += bytes_written;
+            set_position(from + bytes_written);
+            if (static_cast<uint32_t>(bytes_written) != segments[i].count)
+            {
+                return total_bytes_written;
+            }
+        }
+    }
 
-    // Allocate temporary buffer for copy operations
-    m_buffer = new uint8_t[m_buffer_size];
-    assert(m_buffer != nullptr); // Check allocation succeeded
+    flushIfPending(); // After a short or failed segment the next request flushes
+    return total_bytes_written;
+}
 
-    std::cout << std::format("Image size          {} bytes\n", image_size_bytes);
-    std::cout << std::format("m_bitmap_size       #groups = {}, real size = {} (requested: {})\n", m_cow_group_count, m_bitmap_size, bitmap_max_size);
-    std::cout << std::format("m_cow_group_size    {} sectors ({} bytes)\n", m_cow_group_size, m_cow_group_size_bytes);
-    std::cout << std::format("m_scsi_block_size   {} bytes\n", m_scsi_block_size);
-    std::cout << std::format("m_buffer_size       {} bytes\n", m_buffer_size);
+// Queues a request, false if the queue is full
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::submit(uint32_t lba, const void *buf, uint32_t count, bool write, CowAsyncCallback callback, void *context)
+{
+    if (m_async_count == m_async_queue.size())
+    {
+        return false;
+    }
 
-    resetStats();
+    CowAsyncRequest &request = m_async_queue[(m_async_head + m_async_count) % m_async_queue.size()];
+    request.from = offsetFromSector(lba);
+    trace(write ? CowTraceOp::Write : CowTraceOp::Read, request.from, count);
+    request.to = request.from + count;
+    request.offset = request.from;
+    request.buf = static_cast<uint8_t *>(const_cast<void *>(buf)); // Only read from for writes
+    request.write = write;
+    request.callback = callback;
+    request.context = context;
+    m_async_count++;
+    return true;
 }
 
-// Destructor: cleans up allocated memory
-ImageBackingStore::~ImageBackingStore()
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::cow_submit_read(uint32_t lba, void *buf, uint32_t count, CowAsyncCallback callback, void *context)
 {
-    dumpstats();
-    delete[] m_cow_bitmap;
-    delete[] m_buffer;
+    return submit(lba, buf, count, false, callback, context);
+}
+
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::cow_submit_write(uint32_t lba, const void *buf, uint32_t count, CowAsyncCallback callback, void *context)
+{
+    return submit(lba, buf, count, true, callback, context);
 }
 
-std::string ImageBackingStore::stats() const
+/*
+    Transfers the next chunk of the oldest request, then reports it through the callback
+
+    A write longer than a chunk has the original data around it preserved when it starts (as a
+    contiguous run of cow_writev), its chunks are then written without copy-on-write. Its chunks
+    end on group boundaries, so a group is only marked written once complete: until the last chunk
+    is done the unwritten part reads back as before, and mixing in synchronous calls is safe.
+*/
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::poll()
 {
-    double over_read = 0;
-    double over_write = 0;
-    if (m_bytes_requested_read > 0)
+    if (m_async_count == 0)
     {
-        over_read = 100.0 * (static_cast<double>(m_bytes_read_original + m_bytes_read_dirty) / m_bytes_requested_read - 1);
+        return false;
     }
-    if (m_bytes_requested_write > 0)
+    if (!flushWriteBack())
     {
-        over_write = 100.0 * (static_cast<double>(m_bytes_read_original_cow + m_bytes_written_dirty) / m_bytes_requested_write - 1);
+        return true; // Retried by the next poll()
     }
 
-    return std::format("Over-read: {:.2f}%, Over-write: {:.2f}%", over_read, over_write);
-}
+    CowAsyncRequest &request = m_async_queue[m_async_head];
+    uint64_t chunk_end = std::min(request.to, request.offset + m_async_chunk_size);
+    if (request.write && chunk_end < request.to)
+    {
+        // The last group a chunk writes is marked written: end on a group boundary so it is complete,
+        // later than the chunk size if the chunk is smaller than a group
+        uint64_t boundary = offsetFromGroup(groupFromOffset(chunk_end));
+        chunk_end = boundary > request.offset ? boundary : std::min(request.to, groupEndOffset(groupFromOffset(request.offset)));
+    }
+    bool whole = request.offset == request.from && chunk_end == request.to;
+    ssize_t result;
 
-// Dumps detailed I/O statistics
-void ImageBackingStore::dumpstats() const
-{
-    std::cout << std::format("=== I/O Statistics ===\n");
-    std::cout << std::format("Bytes requested to read:  {}\n", m_bytes_requested_read);
-    std::cout << std::format("Bytes read from dirty:    {}\n", m_bytes_read_dirty);
-    std::cout << std::format("Bytes read from original: {}\n", m_bytes_read_original);
-    std::cout << std::format("Bytes requested to write: {}\n", m_bytes_requested_write);
-    std::cout << std::format("Bytes written to dirty:   {}\n", m_bytes_written_dirty);
-    std::cout << std::format("Bytes read from original COW: {}\n", m_bytes_read_original_cow);
-    std::cout << std::format("======================\n");
+    GroupLock lock(*this, request.from, request.to); // Its edges are preserved with the first chunk
+    if (request.write)
+    {
+        if (request.offset == request.from)
+        {
+            m_bytes_requested_write += request.to - request.from;
+        }
+        result = 0;
+        if (request.offset == request.from && !whole)
+        {
+            result = preserveRunEdges(request.from, request.to);
+        }
+        if (result >= 0)
+        {
+            result = cow_write(request.offset, chunk_end, request.buf + (request.offset - request.from), whole);
+        }
+    }
+    else
+    {
+        if (request.offset == request.from)
+        {
+            m_bytes_requested_read += request.to - request.from;
+        }
+        result = cow_read(request.offset, chunk_end, request.buf + (request.offset - request.from));
+    }
+    lock.unlock();
+    flushIfPending();
 
-    if (m_bytes_requested_read > 0)
+    // A short transfer ends the request
+    bool complete = true;
+    if (result >= 0)
     {
-        double over_read = 100.0 * (static_cast<double>(m_bytes_read_original + m_bytes_read_dirty) / m_bytes_requested_read - 1);
-        std::cout << std::format(" Over-read  : {:.2f}%\n", over_read);
+        complete = static_cast<uint64_t>(result) != chunk_end - request.offset || chunk_end == request.to;
+        request.offset += result;
+        set_position(request.offset);
+        result = static_cast<ssize_t>(request.offset - request.from);
     }
-    if (m_bytes_requested_write > 0)
+
+    // The slot is released first, so the callback can queue a new request
+    CowAsyncCallback callback = request.callback;
+    void *context = request.context;
+    if (complete)
+    {
+        m_async_head = (m_async_head + 1) % m_async_queue.size();
+        m_async_count--;
+    }
+    if (callback != nullptr)
     {
-        double over_write = 100.0 * (static_cast<double>(m_bytes_read_original_cow + m_bytes_written_dirty) / m_bytes_requested_write - 1);
-        std::cout << std::format(" Over-write : {:.2f}%\n", over_write);
+        callback(context, result, complete);
     }
+    return m_async_count > 0;
 }
 
-// Returns whether a group is stored in original or dirty file by checking bitmap
-ImageBackingStore::eImageType ImageBackingStore::getGroupImageType(uint32_t group)
+// Copies the original data around [from, to) into the overlay, for a run written piecewise afterwards
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::preserveRunEdges(uint64_t from, uint64_t to)
 {
-    assert(group < m_cow_group_count);
-    return (m_cow_bitmap[group / 8] & (1 << (group % 8))) ? IMG_TYPE_DIRTY : IMG_TYPE_ORIG;
+    uint64_t head_start;
+    uint64_t tail_end;
+    classifyWrite(from, to, head_start, tail_end);
+
+    if (from > head_start)
+    {
+        ssize_t cow_result = performCopyOnWrite(head_start, from);
+        if (cow_result < 0)
+        {
+            return cow_result;
+        }
+    }
+    if (tail_end > to)
+    {
+        ssize_t cow_result = performCopyOnWrite(to, tail_end);
+        if (cow_result < 0)
+        {
+            return cow_result;
+        }
+    }
+    return 0;
 }
 
-// Sets group type in bitmap by setting or clearing the corresponding bit
-void ImageBackingStore::setGroupImageType(uint32_t group, eImageType type)
+// Appends a span, extending the previous one when the memory follows it (or both are zeros)
+// Returns false if no span is left
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::addSpan(const uint8_t *data, uint32_t size, CowSpan *spans, uint32_t &used, uint32_t capacity)
 {
-    assert(group < m_cow_group_count);
-    if (type == IMG_TYPE_DIRTY)
+    if (used > 0)
     {
-        m_cow_bitmap[group / 8] |= (1 << (group % 8));
+        CowSpan &last = spans[used - 1];
+        if (data == nullptr ? last.data == nullptr : last.data != nullptr && last.data + last.size == data)
+        {
+            last.size += size;
+            return true;
+        }
     }
-    else
+    if (used == capacity)
     {
-        m_cow_bitmap[group / 8] &= ~(1 << (group % 8));
+        return false;
     }
+    spans[used++] = {data, size};
+    return true;
 }
 
-// Reads from a single image type (original or dirty) for given byte range
-// Used for implementation the high-level read
-ssize_t ImageBackingStore::cow_read_single(uint32_t from, uint32_t count, void *buf)
+// Maps image bytes [from, to) of an overlay file, one span per contiguous run
+// Returns where mapping stopped (to, unless spans ran out or the file cannot be mapped)
+template <uint32_t BlockSize>
+uint64_t BasicImageBackingStore<BlockSize>::mapLayer(FsFile &file, const uint32_t *slots, uint64_t from, uint64_t to, CowSpan *spans,
+                                                     uint32_t &used, uint32_t capacity)
 {
-    if (getGroupImageType(groupFromOffset(from)) == IMG_TYPE_DIRTY)
+    while (from < to)
     {
-        // Read from overlay/dirty file at same offset as original
-        m_bytes_read_dirty += count;
-        m_fsfile_dirty.seek(from);
-        return m_fsfile_dirty.read(buf, count);
+        uint32_t run_bytes = static_cast<uint32_t>(layerRunEnd(slots, from, to) - from);
+        const uint8_t *data = mapAt(file, layerOffset(slots, from), run_bytes);
+        if (data == nullptr || !addSpan(data, run_bytes, spans, used, capacity))
+        {
+            break;
+        }
+        from += run_bytes;
     }
-    // Read from original file
-    m_bytes_read_original += count;
-    m_fsfile_orig.seek(from);
-    return m_fsfile_orig.read(buf, count);
+    return from;
 }
 
-/*
-    Reads across multiple groups, switching between original and dirty files as needed
-
-|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
-                           |                          |                          |                          |      Groups (3 sectors each)
-           DIRTY           |          CLEAN           |          CLEAN           |          DIRTY           |      Group state before write
-          [---------------------------------------------------------------------------------------]         |      Read 10 blocs, spanning 4 groups
-          [  DIRTY READ   ] [                      CLEAN READ                   ] [  DIRTY READ   ]|        |      Underlying chunks from alternating sources
-|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
-
-    Idea is we repeatedly create a "chunk" that extends from the current read position
-    to the next transition between original and dirty, or to the end of the read request
-*/
-ssize_t ImageBackingStore::cow_read(uint32_t from, uint32_t to, void *buf)
+// Maps [from, to) below the overlay, split by base layer owner
+// Returns the end of the mapped part (short of 'to' when out of spans)
+template <uint32_t BlockSize>
+uint64_t BasicImageBackingStore<BlockSize>::mapBase(uint64_t from, uint64_t to, CowSpan *spans, uint32_t &used, uint32_t capacity)
 {
-    ssize_t total_bytes_read = 0;
-    uint8_t *buffer_ptr = static_cast<uint8_t *>(buf);
-    uint32_t current_offset = from;
-
-    while (current_offset < to)
+    while (from < to)
     {
-        // Find the end of the current chunk (either 'to' or where image type changes)
-        uint32_t current_group = groupFromOffset(current_offset);
-        eImageType current_type = getGroupImageType(current_group);
-        uint32_t chunk_end = current_offset;
-
-        // Extend chunk while image type remains the same and we haven't reached 'to'
-        while (chunk_end < to && groupFromOffset(chunk_end) < m_cow_group_count &&
-               getGroupImageType(groupFromOffset(chunk_end)) == current_type)
+        uint32_t owner_group = groupFromOffset(from);
+        uint8_t owner = m_group_owner != nullptr ? m_group_owner[owner_group] : 0;
+        uint64_t owner_end = to;
+        if (m_group_owner != nullptr)
         {
-            uint32_t next_group_offset = offsetFromGroup(groupFromOffset(chunk_end) + 1);
-            chunk_end = std::min(to, next_group_offset);
+            uint32_t last_group = groupFromOffset(to - 1);
+            while (owner_group < last_group && m_group_owner[owner_group + 1] == owner)
+            {
+                owner_group++;
+            }
+            owner_end = std::min(to, offsetFromGroup(owner_group + 1));
         }
 
-        // Read this chunk using cow_read_single
-        ssize_t bytes_read = cow_read_single(current_offset, chunk_end - current_offset, buffer_ptr);
-        if (bytes_read <= 0)
+        uint64_t end;
+        if (owner == kZeroOwner)
+        {
+            end = addSpan(nullptr, static_cast<uint32_t>(owner_end - from), spans, used, capacity) ? owner_end : from;
+        }
+        else if (owner == 0)
+        {
+            end = mapLayer(*m_base_file, nullptr, from, owner_end, spans, used, capacity);
+        }
+        else
+        {
+            end = mapLayer(m_layers[owner - 1].data, m_layers[owner - 1].slots, from, owner_end, spans, used, capacity);
+        }
+        m_bytes_read_original += end - from;
+        from = end;
+        if (end != owner_end)
+        {
             break;
-
-        total_bytes_read += bytes_read;
-        buffer_ptr += bytes_read;
-        current_offset = chunk_end;
+        }
     }
-
-    return total_bytes_read;
+    return from;
 }
 
-// Wrapper for cow_read that uses current file position and updates it
-ssize_t ImageBackingStore::cow_read(void *buf, size_t count)
+/*
+    Zero-copy counterpart of cow_read: walks the same runs as readChunks (group type, then base layer
+    owner and overlay slots), but instead of reading them describes where they are in the mapped files
+    The read cache and read-ahead are bypassed, they would only add copies
+*/
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_read_spans(size_t count, CowSpan *spans, uint32_t &span_count)
 {
-    m_bytes_requested_read += count;
-
-    uint32_t from = static_cast<uint32_t>(m_current_position);
-    uint32_t to = from + static_cast<uint32_t>(count);
-
-    ssize_t bytes_read = cow_read(from, to, buf);
-
-    // Update current position
-    if (bytes_read > 0)
+    uint32_t capacity = span_count;
+    span_count = 0;
+    if constexpr (!kCanMap<FsFile>)
     {
-        set_position(m_current_position + bytes_read);
+        return -1; // Backend cannot map files
+    }
+    if (!flushWriteBack())
+    {
+        return -1; // Spans can only point into the files
     }
 
-    return bytes_read;
-}
-
-//  Helper function for cow_write
-//  Copies original data to overlay (dirty) file for a specific byte range
-//  Request never spans multiple groups
-ssize_t ImageBackingStore::performCopyOnWrite(uint32_t from_offset, uint32_t to_offset)
-{
-    // Verify both offsets are in the same group
-    assert(groupFromOffset(from_offset) == groupFromOffset(to_offset - 1));
-
-    uint32_t bytes_to_copy = to_offset - from_offset;
-    uint32_t bytes_copied = 0;
+    uint64_t from = m_current_position;
+    uint64_t to = std::min<uint64_t>(from + count, m_image_size_bytes);
+    uint64_t offset = from;
+    trace(CowTraceOp::Read, from, count);
+    m_bytes_requested_read += count;
 
-    m_fsfile_orig.seek(from_offset);
-    m_fsfile_dirty.seek(from_offset);
+    GroupLock lock(*this, from, to); // Concurrent writes to these groups make the spans stale all the same
 
-    while (bytes_copied < bytes_to_copy)
+    while (offset < to)
     {
-        uint32_t chunk_size = std::min(m_buffer_size, bytes_to_copy - bytes_copied);
+        uint32_t group = groupFromOffset(offset);
+        uint64_t run_end = std::min(to, offsetFromGroup(findGroupRunEnd(group, m_cow_group_count)));
+        uint64_t mapped;
 
-        ssize_t bytes_read = m_fsfile_orig.read(m_buffer, chunk_size);
-        if (bytes_read < 0)
+        eImageType type = getGroupImageType(group);
+        if (type == IMG_TYPE_ZERO)
         {
-            return bytes_read; // Return read error immediately
+            mapped = addSpan(nullptr, static_cast<uint32_t>(run_end - offset), spans, span_count, capacity) ? run_end : offset;
+            m_bytes_read_zero += mapped - offset;
         }
-        if (static_cast<uint32_t>(bytes_read) != chunk_size)
+        else if (type == IMG_TYPE_DIRTY)
         {
-            return -1; // Unexpected partial read
+            mapped = mapLayer(m_fsfile_dirty, m_overlay_slots, offset, run_end, spans, span_count, capacity);
+            m_bytes_read_dirty += mapped - offset;
         }
-        m_bytes_read_original_cow += chunk_size;
-
-        ssize_t bytes_written = m_fsfile_dirty.write(m_buffer, chunk_size);
-        if (bytes_written < 0)
+        else if (type == IMG_TYPE_SPLIT)
         {
-            return bytes_written; // Return write error immediately
+            // One group at a time (runs of split groups are rare), by sub-group validity
+            const CowSplitGroup &split = *findSplitGroup(group);
+            uint64_t group_end = std::min(run_end, groupEndOffset(group));
+            mapped = offset;
+            while (mapped < group_end)
+            {
+                bool valid;
+                uint64_t valid_end = splitRunEnd(split, mapped, group_end, valid);
+                uint64_t end;
+                if (valid)
+                {
+                    end = mapLayer(m_fsfile_dirty, m_overlay_slots, mapped, valid_end, spans, span_count, capacity);
+                    m_bytes_read_dirty += end - mapped;
+                }
+                else if (split.zero_below)
+                {
+                    end = addSpan(nullptr, static_cast<uint32_t>(valid_end - mapped), spans, span_count, capacity) ? valid_end : mapped;
+                    m_bytes_read_zero += end - mapped;
+                }
+                else
+                {
+                    end = mapBase(mapped, valid_end, spans, span_count, capacity);
+                }
+                mapped = end;
+                if (end != valid_end)
+                {
+                    break;
+                }
+            }
+            if (mapped == group_end)
+            {
+                run_end = group_end;
+            }
         }
-        if (static_cast<uint32_t>(bytes_written) != chunk_size)
+        else
         {
-            return -1; // Unexpected partial write
+            mapped = mapBase(offset, run_end, spans, span_count, capacity);
         }
-        m_bytes_written_dirty += chunk_size;
 
-        bytes_copied += chunk_size;
+        offset = mapped;
+        if (mapped != run_end)
+        {
+            break; // Out of spans
+        }
     }
 
-    return bytes_to_copy; // Return total bytes copied
+    set_position(offset);
+    return static_cast<ssize_t>(offset - from);
 }
 
-/*
-    Writes data performing copy-on-write for unmodified portions at begining and end
-
-|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
-                  |                          |                          |                          |      Groups (3 sectors each)
-  CLEAN           |          CLEAN           |          CLEAN           |          CLEAN           |      Group state before write
-                  |                  [---------------------------------------------------]         |      Write 6 blocs, spanning 3 groups
-                  |[ COPY...COPY...] [ WRITE...WRITE...WRITE...WRITE...WRITE...WRITE...  ] [ COPY ]|      Actions taken (1), (2), (3)
-  CLEAN           |          DIRTY           |          DIRTY           |          DIRTY           |      Group market dirty after write (4)
-|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|--------|----- Sectors (512 bytes each)
-
-    Implementation follows the above pattern:
-    - (1) Handle first group: if clean and write doesn't start at group beginning, copy original data
-    - (2) Write the main data to dirty file
-    - (3) Handle last group: if clean and write doesn't end at group end, copy original data
-    - (4) Mark all affected groups as dirty
-*/
-ssize_t ImageBackingStore::cow_write(uint32_t from, uint32_t to, const void *buf)
+// Public wrapper for unmap (that uses current file position and updates it)
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_unmap(size_t count)
 {
-    size_t count = to - from;
-
-    uint32_t first_group = groupFromOffset(from);
-    uint32_t last_group = groupFromOffset(to - 1); // Last byte affected
+    trace(CowTraceOp::Unmap, m_current_position, count);
+    uint64_t from = m_current_position;
+    uint64_t to = std::min<uint64_t>(from + count, m_image_size_bytes);
+    if (from >= to)
+    {
+        return flushWriteBack() ? 0 : -1;
+    }
 
-    // Handle first group - copy-on-write if needed and write doesn't start at group beginning
-    if (getGroupImageType(first_group) == IMG_TYPE_ORIG)
+    ssize_t bytes_unmapped = -1;
     {
-        uint32_t group_start = offsetFromGroup(first_group);
-        if (from > group_start)
+        GroupLock lock(*this, from, to);
+        if (flushWriteBack())
         {
-            // Need to preserve data before the write
-            ssize_t cow_result = performCopyOnWrite(group_start, from);
-            if (cow_result < 0)
-            {
-                return cow_result; // Return COW error immediately
-            }
+            bytes_unmapped = unmap(from, to);
         }
     }
-
-    // Handle copy in the dirty file
-    m_fsfile_dirty.seek(from);
-    ssize_t bytes_written = m_fsfile_dirty.write(buf, count);
-    if (bytes_written <= 0)
+    flushIfPending();
+    if (bytes_unmapped > 0)
     {
-        return bytes_written;
+        set_position(m_current_position + bytes_unmapped);
     }
+    return bytes_unmapped;
+}
 
-    m_bytes_written_dirty += count;
+// Public wrapper for cow_write (that uses current file position and updates it)
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_write(const void *buf, size_t count)
+{
+    ssize_t bytes_written = cow_write_at(m_current_position, buf, count);
 
-    // Handle last group - copy-on-write if needed and write doesn't end at group end
-    if (getGroupImageType(last_group) == IMG_TYPE_ORIG)
+    // Update current position (unsure if needed)
+    if (bytes_written > 0)
     {
-        uint32_t group_end = offsetFromGroup(last_group + 1);
-        if (to < group_end)
-        {
-            // Need to preserve data after the write
-            ssize_t cow_result = performCopyOnWrite(to, group_end);
-            if (cow_result < 0)
-            {
-                return cow_result; // Return COW error immediately
-            }
-        }
+        set_position(m_current_position + bytes_written);
     }
 
-    // Mark all affected groups as dirty
-    for (uint32_t group = first_group; group <= last_group; ++group)
+    return bytes_written;
+}
+
+// Writes at 'offset', the position is left alone
+template <uint32_t BlockSize>
+ssize_t BasicImageBackingStore<BlockSize>::cow_write_at(uint64_t offset, const void *buf, size_t count)
+{
+    COW_INSTRUMENT_SCOPE(write_latency, &m_instrumentation.write_calls);
+    trace(CowTraceOp::Write, offset, count);
+    m_bytes_requested_write += count;
+
+    uint64_t to = offset + count;
+    ssize_t bytes_written = -1; // The buffered run could not be written, nor this write ordered after it
     {
-        setGroupImageType(group, IMG_TYPE_DIRTY);
+        GroupLock lock(*this, offset, to);
+        if (m_write_back_capacity > 0 && count > 0 && bufferWrite(offset, to, buf))
+        {
+            bytes_written = count;
+        }
+        else if (flushWriteBack())
+        {
+            bytes_written = cow_write(offset, to, buf);
+        }
     }
 
+    flushIfPending(); // Outside the lock, flush() takes them all
     return bytes_written;
 }
 
-// Public wrapper for cow_write (that uses current file position and updates it)
-ssize_t ImageBackingStore::cow_write(const void *buf, size_t count)
+// Takes [from, to) into the write-back buffer when it extends or rewrites the buffered run, or can start one
+// The run is written once it reaches the end of its first group (so a whole group written sector by sector
+// needs no copy-on-write) or fills the buffer
+// Returns false if the write must go to the overlay now, after the buffered run
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::bufferWrite(uint64_t from, uint64_t to, const void *buf)
 {
-    m_bytes_requested_write += count;
+    uint64_t run_end = m_write_back_start + m_write_back_size;
+    if (m_write_back_size > 0 && from >= m_write_back_start && to <= run_end)
+    {
+        memcpy(m_write_back + (from - m_write_back_start), buf, to - from);
+    }
+    else if (m_write_back_size > 0 && from == run_end && to - m_write_back_start <= m_write_back_capacity)
+    {
+        memcpy(m_write_back + m_write_back_size, buf, to - from);
+        m_write_back_size += static_cast<uint32_t>(to - from);
+    }
+    else
+    {
+        // Nothing to gather for a write reaching the end of its group (or beyond the image)
+        if (to - from >= m_write_back_capacity || to >= groupEndOffset(groupFromOffset(from)) || !flushWriteBack())
+        {
+            return false;
+        }
+        memcpy(m_write_back, buf, to - from);
+        m_write_back_start = from;
+        m_write_back_size = static_cast<uint32_t>(to - from);
+        m_write_back_time = ZULU_COW_TRACE_CLOCK_US();
+    }
+    m_writes_coalesced++;
 
-    uint32_t from = static_cast<uint32_t>(m_current_position);
-    uint32_t to = from + static_cast<uint32_t>(count);
+    if (m_write_back_start + m_write_back_size >= groupEndOffset(groupFromOffset(m_write_back_start)) ||
+        m_write_back_size == m_write_back_capacity)
+    {
+        flushWriteBack(); // On error the run stays buffered, for the next write or flush() to report
+    }
+    return true;
+}
 
-    ssize_t bytes_written = cow_write(from, to, buf);
+// Copies the buffered bytes within [from, to) over 'buf', which holds that range as read from the files
+template <uint32_t BlockSize>
+void BasicImageBackingStore<BlockSize>::patchWriteBack(uint64_t from, uint64_t to, void *buf) const
+{
+    uint64_t start = std::max(from, m_write_back_start);
+    uint64_t end = std::min(to, m_write_back_start + m_write_back_size);
+    if (m_write_back_size > 0 && start < end)
+    {
+        memcpy(static_cast<uint8_t *>(buf) + (start - from), m_write_back + (start - m_write_back_start), end - start);
+    }
+}
 
-    // Update current position (unsure if needed)
-    if (bytes_written > 0)
+// Writes the buffered run with the usual copy-on-write, it stays buffered if that fails
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::flushWriteBack()
+{
+    if (m_write_back_size == 0)
     {
-        set_position(m_current_position + bytes_written);
+        return true;
     }
+    ssize_t bytes_written = cow_write(m_write_back_start, m_write_back_start + m_write_back_size, m_write_back);
+    if (bytes_written != static_cast<ssize_t>(m_write_back_size))
+    {
+        return false;
+    }
+    m_write_back_size = 0;
+    m_write_back_flushes++;
+    return true;
+}
 
-    return bytes_written;
+// Writes the buffered run once it is write_back_delay_us old
+template <uint32_t BlockSize>
+bool BasicImageBackingStore<BlockSize>::writeBackTimer()
+{
+    if (m_write_back_size == 0 || ZULU_COW_TRACE_CLOCK_US() - m_write_back_time < m_write_back_delay_us)
+    {
+        return true;
+    }
+    bool flushed = flushWriteBack();
+    flushIfPending();
+    return flushed;
 }
+
+// The runtime-sized store and the fixed block sizes of disks and CD-ROMs (see zulu_cow.hpp)
+template class BasicImageBackingStore<0>;
+template class BasicImageBackingStore<512>;
+template class BasicImageBackingStore<2048>;
@@ -1,84 +1,616 @@
 #pragma once
 
+// FsFile backend: the in-memory mock used by the tests, or real (optionally memory-mapped) host files
+#if defined(ZULU_COW_FSFILE_POSIX)
+#include "fsfile_posix.h"
+#elif defined(ZULU_COW_FSFILE_MMAP)
+#include "fsfile_mmap.h"
+#else
 #include "fsfile_mock.h"
+#endif
+#include "sector_cache.hpp"
 
+#include <bit>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <format>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
 
-class ImageBackingStore
+// Capacity of the sector read cache of stores with options.read_cache (heap or arena), 0 removes it from the build
+#ifndef ZULU_COW_READ_CACHE_BYTES
+#define ZULU_COW_READ_CACHE_BYTES 16384
+#endif
+
+// Number of asynchronous requests that can be queued in each ImageBackingStore
+#ifndef ZULU_COW_ASYNC_QUEUE_DEPTH
+#define ZULU_COW_ASYNC_QUEUE_DEPTH 4
+#endif
+
+// Counts file calls and times requests into ImageBackingStore::instrumentation(), 0 compiles it out
+// Changes the class layout: every file including zulu_cow.hpp must be built with the same value
+#ifndef ZULU_COW_INSTRUMENTATION
+#define ZULU_COW_INSTRUMENTATION 0
+#endif
+
+// Microsecond clock stamping trace records and instrumentation timings, define it to the platform's own (e.g. micros()) on devices
+#ifndef ZULU_COW_TRACE_CLOCK_US
+#include <chrono>
+#define ZULU_COW_TRACE_CLOCK_US() \
+    static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count())
+#endif
+
+// Concurrent mode: several threads (or cores) can call one store, calls touching different groups run in
+// parallel (see ImageBackingStore::cow_read_at). Groups map to ZULU_COW_LOCK_STRIPES locks, each with its
+// own copy and staging buffers. Read-ahead, write-back, split groups and shared bases keep state for a
+// single stream and fail construction. Backends need read_at/write_at, and with the mmap backend the overlay
+// must already be as large as the image (growing it remaps it under other threads)
+// Changes the class layout like ZULU_COW_INSTRUMENTATION, link with -pthread
+#ifndef ZULU_COW_CONCURRENT
+#define ZULU_COW_CONCURRENT 0
+#endif
+#ifndef ZULU_COW_LOCK_STRIPES
+#define ZULU_COW_LOCK_STRIPES 8
+#endif
+static_assert(ZULU_COW_LOCK_STRIPES >= 1 && ZULU_COW_LOCK_STRIPES <= 64, "ZULU_COW_LOCK_STRIPES must be 1 to 64");
+#if ZULU_COW_CONCURRENT && ZULU_COW_INSTRUMENTATION
+#error "ZULU_COW_INSTRUMENTATION counters are not thread-safe, build it without ZULU_COW_CONCURRENT"
+#endif
+
+#if ZULU_COW_CONCURRENT
+#include <atomic>
+#include <mutex>
+// Lock type (lock() and unlock()), define it to the platform's own (e.g. a wrapper of pico mutex_t) on devices
+#ifndef ZULU_COW_MUTEX
+#define ZULU_COW_MUTEX std::mutex
+#endif
+
+// Counter or state word updated from several threads, relaxed as no other data is published through it
+template <typename T>
+class CowRelaxed
+{
+private:
+    std::atomic<T> m_value{0};
+
+public:
+    CowRelaxed() = default;
+    CowRelaxed(T value) : m_value(value) {}
+    CowRelaxed(const CowRelaxed &other) : m_value(other.load()) {}
+    T load() const { return m_value.load(std::memory_order_relaxed); }
+    operator T() const { return load(); }
+    CowRelaxed &operator=(T value)
+    {
+        m_value.store(value, std::memory_order_relaxed);
+        return *this;
+    }
+    CowRelaxed &operator+=(T value)
+    {
+        m_value.fetch_add(value, std::memory_order_relaxed);
+        return *this;
+    }
+    CowRelaxed &operator-=(T value)
+    {
+        m_value.fetch_sub(value, std::memory_order_relaxed);
+        return *this;
+    }
+    T operator++(int) { return m_value.fetch_add(1, std::memory_order_relaxed); }
+};
+
+template <typename T>
+struct std::formatter<CowRelaxed<T>> : std::formatter<T>
+{
+    auto format(const CowRelaxed<T> &value, std::format_context &context) const { return std::formatter<T>::format(value.load(), context); }
+};
+#else
+template <typename T>
+using CowRelaxed = T;
+#endif
+
+// How the group size is derived from the image size and the bitmap budget
+enum class CowGroupSizing
+{
+    Exact,     // Smallest group size that fits the bitmap (lowest over-write)
+    PowerOfTwo // Rounded up to a power of two, offset to group conversion is a shift
+};
+
+// Files of a read-only overlay layer, as left by an earlier session with a persistent bitmap
+struct CowLayerFiles
+{
+    const char *overlay_filename;
+    const char *bitmap_filename;
+};
+
+template <uint32_t BlockSize>
+class BasicImageBackingStore;
+
+// Read-only original image and copy buffers shared by several ImageBackingStore (one per LUN)
+// Stores on the same base run one at a time, so a single set of copy buffers serves all of them
+// Each store still has its own overlay and bitmap, the base must outlive every store using it
+class CowSharedBase
+{
+public:
+    CowSharedBase(const char *orig_filename, uint32_t buffer_size = 2048, uint32_t buffer_count = 1);
+    ~CowSharedBase();
+
+    FsFile &file() { return m_file; }
+    uint32_t users() const { return m_users; }
+
+private:
+    template <uint32_t BlockSize>
+    friend class BasicImageBackingStore;
+
+    FsFile m_file;           // Original image, opened read-only once for all stores
+    uint8_t *m_buffer;       // buffer_count copy buffers of m_buffer_size bytes
+    uint32_t m_buffer_size;
+    uint32_t m_buffer_count;
+    uint32_t m_users = 0;    // Stores currently using this base
+};
+
+// Statically sized memory for options.arena, declared as a global so it lives in .bss, e.g.
+//   static CowStaticArena<ImageBackingStore::arenaSize(kOptions)> arena;
+template <size_t Bytes>
+struct CowStaticArena
+{
+    alignas(std::max_align_t) uint8_t data[Bytes];
+};
+
+// One entry of a vectored request: 'count' bytes from block 'lba', to or from 'buf'
+struct CowIoSegment
+{
+    uint32_t lba;
+    void *buf;
+    uint32_t count;
+};
+
+// Piece of an image read served in place by cow_read_spans(): 'size' bytes at 'data',
+// or zeros if data is nullptr
+struct CowSpan
+{
+    const uint8_t *data;
+    uint32_t size;
+};
+
+// Request seen by the public I/O methods, trace files are arrays of these records (host byte order)
+enum class CowTraceOp : uint32_t
+{
+    Read,
+    Write,
+    Unmap
+};
+
+struct CowTraceRecord
+{
+    uint64_t timestamp_us; // ZULU_COW_TRACE_CLOCK_US() when the request arrived
+    uint32_t lba;          // First block
+    uint32_t count;        // Length in bytes
+    CowTraceOp op;
+    uint32_t reserved;     // 0
+};
+static_assert(sizeof(CowTraceRecord) == 24, "CowTraceRecord is a file format");
+
+// Receives each request before it is served
+using CowTraceHook = void (*)(void *context, const CowTraceRecord &record);
+
+// Snapshot of the ZULU_COW_INSTRUMENTATION counters (all zeros when compiled out)
+struct CowInstrumentation
+{
+    static constexpr uint32_t kLatencyBuckets = 24; // Bucket i: latencies of std::bit_width(microseconds) == i, last one open
+    static constexpr uint32_t kCallBuckets = 16;    // Bucket i: requests making i file calls, last one open
+
+    uint64_t file_reads = 0;  // FsFile reads, positional or not
+    uint64_t file_writes = 0; // FsFile writes, positional or not
+    uint64_t file_seeks = 0;  // FsFile seeks (backends without read_at/write_at seek before each call)
+
+    std::array<uint64_t, kLatencyBuckets> read_latency = {};  // Public cow_read
+    std::array<uint64_t, kLatencyBuckets> write_latency = {}; // Public cow_write
+    std::array<uint64_t, kLatencyBuckets> copy_latency = {};  // performCopyOnWrite (one partial group kept)
+    std::array<uint64_t, kCallBuckets> read_calls = {};       // File calls made by each cow_read
+    std::array<uint64_t, kCallBuckets> write_calls = {};      // File calls made by each cow_write
+};
+
+// Snapshot of the statistics counters since the last resetStats(), the one stats() and dumpstats() format
+struct CowStats
+{
+    uint64_t bytes_read_original = 0;          // Bytes read from original file
+    uint64_t bytes_read_dirty = 0;             // Bytes read from dirty file
+    uint64_t bytes_written_dirty = 0;          // Bytes written to dirty file
+    uint64_t bytes_requested_read = 0;         // Bytes requested to be read by public methods
+    uint64_t bytes_requested_write = 0;        // Bytes requested to be written by public methods
+    uint64_t bytes_read_original_cow = 0;      // Bytes read from original file due to COW operations
+    uint64_t bitmap_flushes = 0;               // Number of bitmap updates written to the sidecar
+    uint64_t cow_copy_chunks = 0;              // Number of chunks read from original by COW copies
+    uint64_t staged_writes = 0;                // Writes merged with their COW copies in the staging buffer
+    uint64_t groups_written_full = 0;          // Groups entirely overwritten (no COW needed)
+    uint64_t groups_written_partial_clean = 0; // Groups partially overwritten while clean (COW needed)
+    uint64_t groups_written_partial_dirty = 0; // Groups partially overwritten while already dirty
+    uint64_t read_cache_hits = 0;              // Sectors served from the read cache
+    uint64_t read_cache_misses = 0;            // Cacheable sectors read from a file
+    uint64_t read_ahead_bytes = 0;             // Bytes prefetched by read-ahead
+    uint64_t read_ahead_hits = 0;              // Requested bytes served from the read-ahead buffer
+    uint64_t bytes_committed = 0;              // Bytes copied from the overlay into the original
+    uint64_t groups_written_zero = 0;          // Groups set to ZERO by all-zero writes (no overlay I/O)
+    uint64_t bytes_read_zero = 0;              // Bytes of ZERO groups returned without any file read
+    uint64_t groups_unmapped = 0;              // Groups released by cow_unmap()
+    uint64_t groups_split = 0;                 // Clean groups partially written as split groups
+    uint64_t groups_prefilled = 0;             // Split groups settled
+    uint64_t writes_coalesced = 0;             // Writes taken by the write-back buffer
+    uint64_t write_back_flushes = 0;           // Buffered runs written to the overlay
+    uint64_t startup_us = 0;                   // Time the constructor took (kept by resetStats())
+
+    // Bytes read and written beyond what was requested, in percent of the request (0 without requests)
+    double overRead() const
+    {
+        return bytes_requested_read > 0
+                   ? 100.0 * (static_cast<double>(bytes_read_original + bytes_read_dirty + bytes_read_zero) / bytes_requested_read - 1)
+                   : 0;
+    }
+    double overWrite() const
+    {
+        return bytes_requested_write > 0
+                   ? 100.0 * (static_cast<double>(bytes_read_original_cow + bytes_written_dirty) / bytes_requested_write - 1)
+                   : 0;
+    }
+};
+
+// What exportImage() streams
+enum class CowExportFormat
+{
+    Full, // The merged image, byte for byte
+    Delta // Only what differs from the original: a sidecar followed by the overlay it describes
+};
+
+// Receives exported data in order, returns false to abort the export
+using CowExportSink = bool (*)(void *context, const void *data, uint32_t size);
+
+// Called after each chunk of an asynchronous request with the bytes done so far, or a negative error
+// 'complete' is set on the last call for the request
+using CowAsyncCallback = void (*)(void *context, ssize_t result, bool complete);
+
+// Construction parameters of ImageBackingStore
+// Optional features are disabled by default
+struct ImageBackingStoreOptions
+{
+    uint32_t bitmap_size = 1024;           // Maximum size of bitmap in bytes
+    uint32_t buffer_size = 2048;           // Size of the copy buffer in bytes
+    uint32_t scsi_block_size = 512;        // SCSI block size in bytes
+    const char *bitmap_filename = nullptr; // Sidecar file persisting the bitmap (nullptr keeps it in RAM only)
+    uint32_t bitmap_flush_threshold = 64;  // Newly dirty groups accumulated before the sidecar is updated
+    bool compact_overlay = false;          // Append dirty groups to the overlay instead of mirroring image offsets
+    CowGroupSizing group_sizing = CowGroupSizing::Exact;
+    bool double_buffer_copy = false;       // Copy with two buffer_size buffers, reading ahead of the write
+    uint32_t staging_buffer_size = 0;      // Buffer merging partial group copies with the payload (0 disables)
+    bool read_cache = false;               // Serve repeated reads from the ZULU_COW_READ_CACHE_BYTES sector cache
+    uint32_t read_cache_max_sectors = 8;   // Larger reads use cached sectors but do not fill the cache
+    uint32_t read_ahead_sectors = 0;       // Sectors prefetched after sequential reads (0 disables)
+    bool writable_original = false;        // Open the original read-write so commitStep() can merge the overlay
+    const CowLayerFiles *base_layers = nullptr; // Read-only layers stacked on the original, bottom first
+    uint32_t base_layer_count = 0;
+    CowSharedBase *shared_base = nullptr;  // Use this original and its copy buffers (buffer_size ignored, no commit)
+    void *arena = nullptr;                 // Caller-owned memory for all buffers instead of the heap (max_align_t aligned)
+    size_t arena_size = 0;                 // See ImageBackingStore::arenaSize(), reusable once the store is destroyed
+    bool zero_groups = false;              // Track groups written with zeros as ZERO, without overlay data
+    uint32_t async_chunk_sectors = 8;      // Sectors an asynchronous request advances per poll() (writes round to group boundaries)
+    uint32_t split_groups = 0;             // Clean groups a partial write can track in 1/32 sub-groups instead of
+                                           // copying them whole, the rest is copied by prefillStep() (costs a
+                                           // second bitmap, 0 disables)
+    uint32_t write_back_size = 0;          // Buffer gathering small adjacent writes until a group boundary, flush()
+                                           // or writeBackTimer(), written as one (bytes, 0 disables)
+    uint32_t write_back_delay_us = 10000;  // Age at which writeBackTimer() writes the buffered run
+    bool fast_init = false;                // Leave the overlay unsized (it grows with the first write of each group)
+                                           // and print the geometry only through dumpGeometry()
+};
+
+struct CowBitmapHeader; // Sidecar header layout, see zulu_cow.cpp
+
+// Copy-on-write store over an original image, use it as ImageBackingStore
+// BlockSize fixes the SCSI block size (options.scsi_block_size must match) so sector and group math use
+// constant shifts instead of runtime ones or divisions: BasicImageBackingStore<512> for disks, <2048> for
+// CD-ROMs. 0 takes the size at run time, for any geometry. Only these three are built (see zulu_cow.cpp)
+template <uint32_t BlockSize>
+class BasicImageBackingStore
 {
+    static_assert(BlockSize == 0 || std::has_single_bit(BlockSize), "BlockSize must be 0 or a power of two");
+
 private:
-    FsFile m_fsfile_orig;            // Original/pristine image file
+    FsFile m_fsfile_orig;            // Original/pristine image file (unused with a shared base)
+    FsFile *m_base_file;             // m_fsfile_orig or the file of m_shared_base
+    CowSharedBase *m_shared_base = nullptr; // Provides the original and m_buffer when set
     FsFile m_fsfile_dirty;           // Overlay file with modified sectors
-    uint8_t *m_cow_bitmap;           // Bitmap tracking which groups are dirty   (typically 1024 bytes = 8192 groups)
+    uint32_t *m_cow_bitmap = nullptr; // Bitmap tracking which groups are dirty   (typically 1024 bytes = 8192 groups)
+                                     // Stored as 32-bit words so runs can be scanned a word at a time
     uint32_t m_bitmap_size;          // Size of bitmap in bytes
+    uint32_t m_bitmap_max_size;      // Size requested by options.bitmap_size
     uint32_t m_cow_group_count;      // Total number of groups               (Number of bits in the bitmap)
                                      // The last group may be incomplete
+    CowRelaxed<uint32_t> m_dirty_group_count = 0; // Number of bits set in the bitmap
+    uint32_t *m_zero_bitmap = nullptr; // Groups reading as zeros, only meaningful where the dirty bit is set
+                                       // (nullptr unless options.zero_groups)
     uint32_t m_cow_group_size;       // Size of each group in sectors         (10 for a disk of 81920 sectors -- 40.96 Mb)
     uint32_t m_cow_group_size_bytes; // Size of each group in bytes           (5120 in the example above)
+    uint32_t m_cow_group_size_exact; // Group size the bitmap budget allows    (differs from m_cow_group_size if rounded)
+    uint32_t m_group_offset_shift;   // log2 of m_cow_group_size_bytes, 0 if not a power of two
 
     uint32_t m_scsi_block_size; // SCSI block size in bytes
-    uint8_t *m_buffer;          // Pre-allocated buffer for copy operations
+    uint32_t m_scsi_block_shift; // log2 of m_scsi_block_size, 0 if not a power of two
+    uint64_t m_image_size_bytes; // Size of the original image in bytes
+    uint8_t *m_buffer = nullptr; // Pre-allocated buffer(s) for copy operations (owned by m_shared_base if set)
     uint32_t m_buffer_size;
+    uint32_t m_copy_chunk_size;    // Bytes per copy buffer, m_buffer_size rounded down to whole sectors
+    uint32_t m_copy_chunk_sectors; // m_copy_chunk_size in sectors
+    uint32_t m_copy_buffer_count;  // 1, or 2 when double buffering
+    uint8_t *m_staging_buffer = nullptr; // Head copy + payload + tail copy assembled for a single write
+    uint32_t m_staging_buffer_size = 0;
+
+    // Write-back buffer: one run of acknowledged writes not in the overlay yet, reads patch it in
+    uint8_t *m_write_back = nullptr;
+    uint32_t m_write_back_capacity = 0;
+    uint32_t m_write_back_size = 0;  // Bytes buffered (0: empty)
+    uint64_t m_write_back_start = 0; // Image offset of the buffered run
+    uint64_t m_write_back_time = 0;  // ZULU_COW_TRACE_CLOCK_US() when the run started
+    uint32_t m_write_back_delay_us = 0;
+
+    // Sector read cache, keyed by image sector so COW copies (which do not change content) leave it valid
+    using ReadCache = SectorCache<ZULU_COW_READ_CACHE_BYTES>;
+    ReadCache *m_read_cache = nullptr; // nullptr unless options.read_cache (and a sector fits)
+    uint32_t m_read_cache_max_sectors = 0;
+
+    // Read-ahead: sequential cow_read calls prefetch the sectors that follow into m_read_ahead_buffer
+    uint8_t *m_read_ahead_buffer = nullptr;
+    uint32_t m_read_ahead_capacity = 0;     // Size of m_read_ahead_buffer in bytes (0: read-ahead disabled)
+    uint64_t m_read_ahead_start = 0;        // Image offset of the prefetched data
+    uint32_t m_read_ahead_size = 0;         // Bytes of prefetched data (0: buffer empty)
+    uint64_t m_last_read_end = UINT64_MAX;  // End of the previous read, to detect sequential access
+    uint32_t m_sequential_reads = 0;        // Consecutive reads that continued the previous one
+
+    // Caller-owned arena all buffers are carved from (nullptr: heap)
+    uint8_t *m_arena = nullptr;
+    size_t m_arena_size = 0;
+    size_t m_arena_used = 0;
+
+    // Read-only base layers between the original and the overlay (writes only go to the overlay)
+    struct CowLayer
+    {
+        FsFile data;               // Overlay file of the layer
+        uint32_t *slots = nullptr; // Slot table if the layer is a compact overlay
+    };
+    static constexpr uint32_t kMaxBaseLayers = 254;
+    static constexpr uint8_t kZeroOwner = 0xff; // Group is ZERO in the top-most layer holding it
+    CowLayer *m_layers = nullptr;
+    uint32_t m_layer_count = 0;
+    uint8_t *m_group_owner = nullptr;       // Top-most base layer holding each group (0: original, kZeroOwner: zeros)
+                                            // nullptr without layers
+
+#if ZULU_COW_INSTRUMENTATION
+    CowInstrumentation m_instrumentation;
+#endif
+
+    // Split groups: a clean group partially written gets one of a bounded pool of entries tracking which of
+    // its kSplitSubGroups sub-groups hold overlay data, so only sub-groups are copied. The group keeps its
+    // whole overlay space (same offsets or slot), the other sub-groups read what lies below the overlay
+    struct CowSplitGroup
+    {
+        uint32_t group = kNoSplitGroup; // Group using the entry (kNoSplitGroup: free)
+        uint32_t valid = 0;             // Sub-groups holding overlay data
+        bool zero_below = false;        // Split from a ZERO group: the other sub-groups read as zeros
+    };
+    static constexpr uint32_t kSplitSubGroups = 32;
+    static constexpr uint32_t kNoSplitGroup = 0xffffffff;
+    CowSplitGroup *m_split_groups = nullptr;
+    uint32_t m_split_group_capacity = 0;    // Pool entries (0: groups are always copied whole)
+    uint32_t *m_split_bitmap = nullptr;     // Groups with a pool entry, only meaningful where the dirty bit is set
+    uint32_t m_split_sectors = 0;           // Sectors per sub-group
+
+    // Trace recorder (nullptr: not tracing)
+    CowTraceHook m_trace_hook = nullptr;
+    void *m_trace_context = nullptr;
+
+    // Concurrent mode: group g is guarded by stripe lock g % kLockStripes, a call locks the stripes of its
+    // groups in increasing order (whole-image calls lock them all) and copies through the buffers of the
+    // stripe of the group it copies. m_state_lock guards what groups share: overlay slot allocation,
+    // sidecar change tracking and the read cache. It is only taken with stripe locks held, never the reverse
+    static constexpr uint32_t kLockStripes = ZULU_COW_CONCURRENT ? ZULU_COW_LOCK_STRIPES : 1;
+#if ZULU_COW_CONCURRENT
+    std::array<ZULU_COW_MUTEX, kLockStripes> m_stripe_locks;
+    ZULU_COW_MUTEX m_state_lock;
+#endif
+    class GroupLock;
+
+    // Asynchronous requests, served in order by poll() one chunk at a time
+    struct CowAsyncRequest
+    {
+        uint64_t from;
+        uint64_t to;
+        uint64_t offset;           // Next byte to transfer
+        uint8_t *buf;
+        bool write;
+        CowAsyncCallback callback;
+        void *context;
+    };
+    std::array<CowAsyncRequest, ZULU_COW_ASYNC_QUEUE_DEPTH> m_async_queue;
+    uint32_t m_async_head = 0;     // Index of the oldest request
+    uint32_t m_async_count = 0;    // Requests queued
+    uint32_t m_async_chunk_size;   // Bytes transferred per poll()
+
+    // Commit of the overlay into the original
+    bool m_original_writable = false;       // Original opened read-write (commit allowed)
+    uint32_t m_commit_cursor = 0;           // Next group examined by commitStep()
+
+    // Persistent bitmap (sidecar file: header sector followed by the bitmap)
+    FsFile m_fsfile_bitmap;                 // Sidecar file, only used when m_bitmap_persistent
+    bool m_bitmap_persistent = false;       // Bitmap is saved to and reloaded from the sidecar
+    uint32_t m_bitmap_generation = 0;       // Generation recorded in the sidecar header
+    bool m_bitmap_resumed = false;          // The bitmap was loaded from the sidecar
+    uint32_t m_bitmap_flush_threshold = 0;  // Newly dirty groups before an automatic flush
+    CowRelaxed<uint32_t> m_bitmap_pending_groups = 0; // Groups marked dirty in RAM but not yet in the sidecar
+    uint32_t m_bitmap_changed_first = 0;    // First bitmap word changed since last flush
+    uint32_t m_bitmap_changed_end = 0;      // One past last bitmap word changed since last flush
+    uint32_t m_zero_changed_first = 0;      // First zero bitmap word changed since last flush
+    uint32_t m_zero_changed_end = 0;        // One past last zero bitmap word changed since last flush
 
-    // Statistics counters
-    mutable uint64_t m_bytes_read_original = 0;     // Bytes read from original file
-    mutable uint64_t m_bytes_read_dirty = 0;        // Bytes read from dirty file
-    mutable uint64_t m_bytes_written_dirty = 0;     // Bytes written to dirty file
-    mutable uint64_t m_bytes_requested_read = 0;    // Bytes requested to be read by public methods
-    mutable uint64_t m_bytes_requested_write = 0;   // Bytes requested to be written by public methods
-    mutable uint64_t m_bytes_read_original_cow = 0; // Bytes read from original file due to COW operations
+    // Compact overlay: groups are stored in slots appended to the overlay file on first write
+    bool m_compact_overlay = false;         // Overlay uses m_overlay_slots instead of same-offset storage
+    uint32_t *m_overlay_slots = nullptr;    // Overlay slot of each group (kNoOverlaySlot if never written)
+    uint32_t m_overlay_slot_count = 0;      // Number of slots in the overlay file, new ones are appended at the end
+    uint32_t m_slots_changed_first = 0;     // First group whose slot was assigned or released since last flush
+    uint32_t m_slots_changed_end = 0;       // One past last group whose slot was assigned or released since last flush
+    uint32_t *m_free_slots = nullptr;       // Slots released by unmap: reusable ones at the front, pending ones at the back
+    uint32_t m_free_slot_count = 0;         // Reusable slots, taken before new ones are appended
+    uint32_t m_pending_slot_count = 0;      // Released slots the sidecar still maps, reusable after the next flush
+
+    // Statistics counters (relaxed atomics in concurrent builds)
+    mutable CowRelaxed<uint64_t> m_bytes_read_original = 0;          // Bytes read from original file
+    mutable CowRelaxed<uint64_t> m_bytes_read_dirty = 0;             // Bytes read from dirty file
+    mutable CowRelaxed<uint64_t> m_bytes_written_dirty = 0;          // Bytes written to dirty file
+    mutable CowRelaxed<uint64_t> m_bytes_requested_read = 0;         // Bytes requested to be read by public methods
+    mutable CowRelaxed<uint64_t> m_bytes_requested_write = 0;        // Bytes requested to be written by public methods
+    mutable CowRelaxed<uint64_t> m_bytes_read_original_cow = 0;      // Bytes read from original file due to COW operations
+    mutable CowRelaxed<uint64_t> m_bitmap_flushes = 0;               // Number of bitmap updates written to the sidecar
+    mutable CowRelaxed<uint64_t> m_cow_copy_chunks = 0;              // Number of chunks read from original by COW copies
+    mutable CowRelaxed<uint64_t> m_staged_writes = 0;                // Writes merged with their COW copies in the staging buffer
+    mutable CowRelaxed<uint64_t> m_groups_written_full = 0;          // Groups entirely overwritten (no COW needed)
+    mutable CowRelaxed<uint64_t> m_groups_written_partial_clean = 0; // Groups partially overwritten while clean (COW needed)
+    mutable CowRelaxed<uint64_t> m_groups_written_partial_dirty = 0; // Groups partially overwritten while already dirty
+    mutable CowRelaxed<uint64_t> m_read_cache_hits = 0;              // Sectors served from the read cache
+    mutable CowRelaxed<uint64_t> m_read_cache_misses = 0;            // Cacheable sectors read from a file
+    mutable CowRelaxed<uint64_t> m_read_ahead_bytes = 0;             // Bytes prefetched by read-ahead
+    mutable CowRelaxed<uint64_t> m_read_ahead_hits = 0;              // Requested bytes served from the read-ahead buffer
+    mutable CowRelaxed<uint64_t> m_bytes_committed = 0;              // Bytes copied from the overlay into the original
+    mutable CowRelaxed<uint64_t> m_groups_written_zero = 0;          // Groups set to ZERO by all-zero writes (no overlay I/O)
+    mutable CowRelaxed<uint64_t> m_bytes_read_zero = 0;              // Bytes of ZERO groups returned without any file read
+    mutable CowRelaxed<uint64_t> m_groups_unmapped = 0;              // Groups released by cow_unmap()
+    mutable CowRelaxed<uint64_t> m_groups_split = 0;                 // Clean groups partially written as split groups (no whole-group copy)
+    mutable CowRelaxed<uint64_t> m_groups_prefilled = 0;             // Split groups settled (by prefillStep() or before a flush)
+    mutable CowRelaxed<uint64_t> m_writes_coalesced = 0;             // Writes taken by the write-back buffer
+    mutable CowRelaxed<uint64_t> m_write_back_flushes = 0;           // Buffered runs written to the overlay
+    uint64_t m_startup_us = 0;                                       // Time the constructor took (kept by resetStats())
 
 public:
     // Constructor for copy-on-write setup
-    ImageBackingStore(const char *orig_filename, const char *dirty_filename,
-                      uint32_t bitmap_size = 1024, uint32_t buffer_size = 2048, uint32_t scsi_block_size = 512);
+    BasicImageBackingStore(const char *orig_filename, const char *dirty_filename, uint32_t bitmap_size = 1024,
+                           uint32_t buffer_size = 2048, uint32_t scsi_block_size = BlockSize != 0 ? BlockSize : 512);
+    BasicImageBackingStore(const char *orig_filename, const char *dirty_filename, const ImageBackingStoreOptions &options);
 
     // Destructor to clean up allocated memory
-    ~ImageBackingStore();
+    ~BasicImageBackingStore();
+
+    // Arena size that fits any image these options can describe (largest group count, all layers compact)
+    static constexpr size_t arenaSize(const ImageBackingStoreOptions &options)
+    {
+        size_t groups = static_cast<size_t>(options.bitmap_size) * 8;
+        size_t sector = options.scsi_block_size;
+        size_t size = (groups + 31) / 32 * sizeof(uint32_t);
+        if (options.shared_base == nullptr)
+        {
+            size += std::max<size_t>(options.buffer_size, sector) * (options.double_buffer_copy ? 2 : 1) * kLockStripes;
+        }
+        size += options.staging_buffer_size * kLockStripes;
+        size += options.write_back_size;
+        size += options.read_ahead_sectors * sector;
+        size += options.read_cache && ReadCache::fits(options.scsi_block_size) ? sizeof(ReadCache) : 0;
+        size += options.compact_overlay ? 2 * groups * sizeof(uint32_t) : 0;
+        size += options.zero_groups ? (groups + 31) / 32 * sizeof(uint32_t) : 0;
+        size += options.split_groups > 0 ? options.split_groups * sizeof(CowSplitGroup) + (groups + 31) / 32 * sizeof(uint32_t) : 0;
+        if (options.base_layer_count > 0)
+        {
+            size += options.base_layer_count * (sizeof(CowLayer) + groups * sizeof(uint32_t)) + groups;
+        }
+        return size + (13 + options.base_layer_count) * alignof(std::max_align_t); // Alignment of each allocation
+    }
 
     // For testing
-    FsFile &getOriginalFile() { return m_fsfile_orig; }
+    FsFile &getOriginalFile() { return *m_base_file; }
     FsFile &getDirtyFile() { return m_fsfile_dirty; }
     std::vector<uint8_t> recreate()
     {
-        std::vector<uint8_t> data(m_fsfile_orig.size());
-        uint32_t group_size_bytes = m_cow_group_size * m_scsi_block_size;
-
-        // Loop over the bitmap, copying orginal or dirty data as needed
-        for (uint32_t group = 0; group < m_cow_group_count; ++group)
-        {
-            uint64_t pos = group * group_size_bytes;
-            uint64_t bytes_to_copy = std::min(static_cast<uint64_t>(group_size_bytes),
-                                              m_fsfile_orig.size() - pos);
-
-            // std::cout << std::format("Group {} at pos {} is {}\n", group, pos, (getGroupImageType(group) == IMG_TYPE_DIRTY) ? "DIRTY" : "ORIG");
-
-            if (getGroupImageType(group) == IMG_TYPE_DIRTY)
-            {
-                std::copy(m_fsfile_dirty.data().data() + pos,
-                          m_fsfile_dirty.data().data() + pos + bytes_to_copy,
-                          data.data() + pos);
-            }
-            else
-            {
-                // std::cout << std::format("  Copying ORIG data from overlay at pos {} size {}\n", pos, group_size_bytes);
-                std::copy(m_fsfile_orig.data().data() + pos,
-                          m_fsfile_orig.data().data() + pos + bytes_to_copy,
-                          data.data() + pos);
-            }
-        }
+        std::vector<uint8_t> data;
+        auto append = [](void *context, const void *chunk, uint32_t size) {
+            std::vector<uint8_t> &out = *static_cast<std::vector<uint8_t> *>(context);
+            out.insert(out.end(), static_cast<const uint8_t *>(chunk), static_cast<const uint8_t *>(chunk) + size);
+            return true;
+        };
+        exportImage(CowExportFormat::Full, append, &data);
         return data;
     }
     // Copy-on-write I/O operations
     ssize_t cow_read(void *buf, size_t count);
     ssize_t cow_write(const void *buf, size_t count);
+    // Same without the shared position, which they leave unchanged: the calls to use from several threads
+    // in concurrent builds (the position and the asynchronous queue belong to a single thread)
+    ssize_t cow_read_at(uint64_t offset, void *buf, size_t count);
+    ssize_t cow_write_at(uint64_t offset, const void *buf, size_t count);
+    ssize_t cow_readv(const CowIoSegment *segments, uint32_t segment_count);  // Scatter/gather, positions at the end
+    ssize_t cow_writev(const CowIoSegment *segments, uint32_t segment_count); // of the last segment done
+    ssize_t cow_unmap(size_t count); // UNMAP/TRIM, unmapped data reads back unspecified (zeros with zero_groups)
+    uint32_t overlaySlotCount() const { return m_overlay_slot_count; } // Compact overlay size in groups, reused slots included
+
+    // Zero-copy read on backends that can map files (mmap, mock): describes the next 'count' bytes as
+    // up to span_count spans into the files, span_count is set to the spans used
+    // Returns the bytes covered (less if spans ran out) or -1 if the backend cannot map
+    // Spans stay valid until the next write
+    ssize_t cow_read_spans(size_t count, CowSpan *spans, uint32_t &span_count);
     void set_position(uint64_t pos) { m_current_position = pos; }
 
+    // Asynchronous I/O: requests are queued (false when the queue is full) and progress one chunk per
+    // poll(), in order. Call poll() while the previous chunk is on the SCSI bus (e.g. during its DMA)
+    // so card and bus transfers overlap, the callback reports each chunk done
+    bool cow_submit_read(uint32_t lba, void *buf, uint32_t count, CowAsyncCallback callback, void *context);
+    bool cow_submit_write(uint32_t lba, const void *buf, uint32_t count, CowAsyncCallback callback, void *context);
+    bool poll(); // Returns false once nothing is queued
+    uint32_t pendingRequests() const { return m_async_count; }
+
+    // Makes overlay data durable, then writes pending bitmap changes to the sidecar (SYNCHRONIZE CACHE)
+    bool flush();
+
+    // Write-back buffer (options.write_back_size): writes the buffered run to the overlay, false on error
+    // (the run stays buffered). writeBackTimer() does it once the run is write_back_delay_us old, call it
+    // from the host's timer or idle loop. Other calls that need the overlay current flush it first
+    bool flushWriteBack();
+    bool writeBackTimer();
+
+    // Merges up to max_groups dirty groups into the original (needs options.writable_original)
+    // Call repeatedly while idle, returns groups committed (0 when done) or a negative error
+    ssize_t commitStep(uint32_t max_groups);
+    uint32_t dirtyGroupCount() const { return m_dirty_group_count; }
+
+    // Copies the rest of up to max_groups split groups (see options.split_groups) from below the overlay,
+    // the part of copy-on-write that partial writes leave out of the command path, freeing their entries
+    // Call repeatedly while idle, returns groups completed (0 when none is left) or a negative error
+    ssize_t prefillStep(uint32_t max_groups);
+    uint32_t splitGroupCount() const;
+
+    // Drops all changes and reverts to the original, in time proportional to the bitmap size
+    bool discard();
+
+    // Streams the image to 'sink' in sequential runs of up to buffer_size bytes (default: the copy buffer)
+    // A Delta export is a compact sidecar with zero groups, deltaSidecarSize() bytes, then its overlay:
+    // split there, the two files reopen over the original with compact_overlay and zero_groups, and
+    // base layers are folded in. Returns bytes streamed, or -1 on a read error or when the sink aborts
+    ssize_t exportImage(CowExportFormat format, CowExportSink sink, void *context, void *buffer = nullptr, uint32_t buffer_size = 0);
+    uint32_t deltaSidecarSize() const;
+
+    // Records every request of the public I/O methods (vectored ones per segment, asynchronous ones
+    // when submitted) until the hook is reset to nullptr
+    void setTraceHook(CowTraceHook hook, void *context)
+    {
+        m_trace_hook = hook;
+        m_trace_context = context;
+    }
+
     // Statistics
+#if ZULU_COW_INSTRUMENTATION
+    const CowInstrumentation &instrumentation() const { return m_instrumentation; }
+    void resetInstrumentation() { m_instrumentation = {}; }
+#else
+    CowInstrumentation instrumentation() const { return {}; }
+    void resetInstrumentation() {}
+#endif
     void dumpstats() const;
+    void dumpGeometry() const; // Printed on construction unless options.fast_init
+    CowStats statistics() const;
     std::string stats() const;
     void resetStats()
     {
@@ -88,30 +620,205 @@ public:
         m_bytes_requested_read = 0;
         m_bytes_requested_write = 0;
         m_bytes_read_original_cow = 0;
+        m_bitmap_flushes = 0;
+        m_cow_copy_chunks = 0;
+        m_staged_writes = 0;
+        m_groups_written_full = 0;
+        m_groups_written_partial_clean = 0;
+        m_groups_written_partial_dirty = 0;
+        m_read_cache_hits = 0;
+        m_read_cache_misses = 0;
+        m_read_ahead_bytes = 0;
+        m_read_ahead_hits = 0;
+        m_bytes_committed = 0;
+        m_groups_written_zero = 0;
+        m_bytes_read_zero = 0;
+        m_groups_unmapped = 0;
+        m_groups_split = 0;
+        m_groups_prefilled = 0;
+        m_writes_coalesced = 0;
+        m_write_back_flushes = 0;
     }
 
 protected:
-    ssize_t cow_read_single(uint32_t from, uint32_t count, void *buf);
+    // Internal I/O works on 64-bit byte offsets, a single request stays below 4 GiB
+    ssize_t cow_read_single(uint64_t from, uint32_t count, void *buf);
+    ssize_t readSingleSource(uint64_t from, uint32_t count, void *buf);
+    void updateReadCache(uint64_t from, uint64_t to, const void *buf);
 
-    ssize_t cow_read(uint32_t from, uint32_t to, void *buf);
+    ssize_t cow_read(uint64_t from, uint64_t to, void *buf);
+    ssize_t readChunks(uint64_t from, uint64_t to, void *buf);
+    void prefetchReadAhead(uint64_t from);
 
-    ssize_t cow_write(uint32_t from, uint32_t to, const void *buf);
+    ssize_t cow_write(uint64_t from, uint64_t to, const void *buf, bool preserve = true);
+    void classifyWrite(uint64_t from, uint64_t to, uint64_t &head_start, uint64_t &tail_end);
+    ssize_t preserveRunEdges(uint64_t from, uint64_t to);
+    void trace(CowTraceOp op, uint64_t from, size_t count)
+    {
+        if (m_trace_hook != nullptr)
+        {
+            m_trace_hook(m_trace_context, {ZULU_COW_TRACE_CLOCK_US(), sectorFromOffset(from), static_cast<uint32_t>(count), op, 0});
+        }
+    }
+    bool submit(uint32_t lba, const void *buf, uint32_t count, bool write, CowAsyncCallback callback, void *context);
+    ssize_t writeZeroGroups(uint64_t from, uint64_t to, const void *buf, uint32_t first_group, uint32_t end_group, bool preserve);
+    ssize_t unmap(uint64_t from, uint64_t to);
 
     // Copy-on-write bitmap management
     enum eImageType
     {
         IMG_TYPE_ORIG = 0,
-        IMG_TYPE_DIRTY = 1
+        IMG_TYPE_DIRTY = 1,
+        IMG_TYPE_ZERO = 2, // Dirty, but reads as zeros and has no data in the overlay
+        IMG_TYPE_SPLIT = 3 // Dirty, but only the sub-groups valid in its CowSplitGroup have overlay data
     };
     eImageType getGroupImageType(uint32_t group);
     void setGroupImageType(uint32_t group, eImageType type);
+    void setGroupRangeImageType(uint32_t first_group, uint32_t end_group, eImageType type);
+    uint32_t findGroupRunEnd(uint32_t group, uint32_t limit);
+    void noteBitmapChange(uint32_t word_index, uint32_t changed_bits);
+    void noteZeroBitmapChange(uint32_t word_index, uint32_t changed_bits);
+    uint32_t dirtyWord(uint32_t word_index) const { return loadWord(m_cow_bitmap, word_index); }
+    uint32_t zeroWord(uint32_t word_index) const { return m_zero_bitmap ? loadWord(m_zero_bitmap, word_index) & dirtyWord(word_index) : 0; }
+    uint32_t splitWord(uint32_t word_index) const { return m_split_bitmap ? loadWord(m_split_bitmap, word_index) & dirtyWord(word_index) : 0; }
+
+    // Bitmap words hold groups of several lock stripes, concurrent builds load and update them atomically
+    // updateWord() sets or clears 'mask' and returns the bits that changed
+#if ZULU_COW_CONCURRENT
+    static uint32_t loadWord(const uint32_t *bitmap, uint32_t word_index)
+    {
+        return std::atomic_ref<uint32_t>(const_cast<uint32_t &>(bitmap[word_index])).load(std::memory_order_relaxed);
+    }
+    static uint32_t updateWord(uint32_t *bitmap, uint32_t word_index, uint32_t mask, bool set)
+    {
+        std::atomic_ref<uint32_t> word(bitmap[word_index]);
+        return mask & (set ? ~word.fetch_or(mask, std::memory_order_relaxed) : word.fetch_and(~mask, std::memory_order_relaxed));
+    }
+#else
+    static uint32_t loadWord(const uint32_t *bitmap, uint32_t word_index) { return bitmap[word_index]; }
+    static uint32_t updateWord(uint32_t *bitmap, uint32_t word_index, uint32_t mask, bool set)
+    {
+        uint32_t previous = bitmap[word_index];
+        bitmap[word_index] = set ? previous | mask : previous & ~mask;
+        return previous ^ bitmap[word_index];
+    }
+#endif
+    uint32_t lockStripe(uint32_t group) const { return group % kLockStripes; }
+    uint8_t *copyBuffer(uint32_t group) const { return m_buffer + lockStripe(group) * m_copy_chunk_size * m_copy_buffer_count; }
+    uint8_t *stagingBuffer(uint32_t group) const { return m_staging_buffer + lockStripe(group) * m_staging_buffer_size; }
+    void flushIfPending();
+    ssize_t commitGroup(uint32_t group);
+
+    // Split groups
+    CowSplitGroup *findSplitGroup(uint32_t group);
+    bool splitGroup(uint32_t group, eImageType type);
+    void releaseSplitGroups(uint32_t word_index, uint32_t released_bits);
+    void markWritten(uint64_t from, uint64_t to);
+    uint64_t splitRunEnd(const CowSplitGroup &split, uint64_t from, uint64_t to, bool &valid) const;
+    uint32_t subGroupFromOffset(uint32_t group, uint64_t offset) const { return (sectorFromOffset(offset - offsetFromGroup(group))) / m_split_sectors; }
+    uint64_t subGroupOffset(uint32_t group, uint32_t sub_group) const
+    {
+        return std::min(offsetFromGroup(group) + offsetFromSector(sub_group * m_split_sectors), groupEndOffset(group));
+    }
+    ssize_t readSplit(uint64_t from, uint32_t count, void *buf);
+    ssize_t settleSplitGroup(CowSplitGroup &split);
+    bool settleSplitGroups();
+
+    // Write-back buffer
+    bool bufferWrite(uint64_t from, uint64_t to, const void *buf);
+    void patchWriteBack(uint64_t from, uint64_t to, void *buf) const;
+
+    // File I/O at an offset, counted by the instrumentation
+    template <typename File>
+    ssize_t readAt(File &file, uint64_t offset, void *buf, size_t count);
+    template <typename File>
+    ssize_t writeAt(File &file, uint64_t offset, const void *buf, size_t count);
 
-    uint32_t groupFromOffset(uint32_t offset) { return offset / m_cow_group_size / m_scsi_block_size; }
-    uint32_t offsetFromGroup(uint32_t group) { return group * m_cow_group_size * m_scsi_block_size; }
+    // Sidecar bitmap persistence
+    bool readSidecarHeader(FsFile &file, CowBitmapHeader &header);
+    bool sidecarMatchesImage(const CowBitmapHeader &header) const;
+    bool readSidecarWords(FsFile &file, uint32_t offset, uint32_t *bitmap);
+    bool readSidecarBody(FsFile &file, uint32_t *bitmap, uint32_t *slots);
+    bool loadBitmap();
+    bool loadBaseLayers(const CowLayerFiles *layers, uint32_t layer_count);
+    template <typename T>
+    T *allocate(size_t count);
+    template <typename T>
+    void release(T *data, size_t count = 0); // count: elements to destroy, only needed for non-trivial T
+    void releaseBuffers();
+    bool writeBitmapHeader();
+    bool writeSidecarSectors(uint32_t base, const void *data, uint32_t size, uint32_t from, uint32_t to);
+    uint32_t slotTableOffset() const;
+    uint32_t zeroBitmapOffset(bool compact) const;
+
+    // Overlay placement (identity unless compact overlay is enabled)
+    static constexpr uint32_t kNoOverlaySlot = 0xffffffff;
+    void allocateOverlaySlots(uint32_t first_group, uint32_t end_group);
+    void releaseOverlaySlots(uint32_t first_group, uint32_t end_group);
+    void noteSlotChange(uint32_t group);
+    void rebuildFreeSlots();
+    uint64_t layerOffset(const uint32_t *slots, uint64_t offset) const;
+    uint64_t layerRunEnd(const uint32_t *slots, uint64_t from, uint64_t to) const;
+    uint64_t overlayOffset(uint64_t offset) const { return layerOffset(m_overlay_slots, offset); }
+    uint64_t overlayRunEnd(uint64_t from, uint64_t to) const { return layerRunEnd(m_overlay_slots, from, to); }
+    ssize_t readMapped(FsFile &file, const uint32_t *slots, uint64_t from, uint32_t count, void *buf);
+    ssize_t readOverlay(uint64_t from, uint32_t count, void *buf);
+    ssize_t readBase(uint64_t from, uint32_t count, void *buf);
+    ssize_t readPreserved(uint64_t from, uint32_t count, void *buf);
+    bool addSpan(const uint8_t *data, uint32_t size, CowSpan *spans, uint32_t &used, uint32_t capacity);
+    uint64_t mapLayer(FsFile &file, const uint32_t *slots, uint64_t from, uint64_t to, CowSpan *spans, uint32_t &used, uint32_t capacity);
+    uint64_t mapBase(uint64_t from, uint64_t to, CowSpan *spans, uint32_t &used, uint32_t capacity);
+    ssize_t writeOverlay(uint64_t from, uint32_t count, const void *buf);
+
+    // Group math is done on 32-bit sector numbers, offsets are only shifted (no 64-bit division)
+    // With a fixed BlockSize, sector conversions (and the sector part of group numbers) are constant shifts
+    static constexpr uint32_t kBlockShift = BlockSize != 0 ? std::countr_zero(BlockSize) : 0;
+    uint32_t blockSize() const
+    {
+        if constexpr (BlockSize != 0)
+        {
+            return BlockSize;
+        }
+        return m_scsi_block_size;
+    }
+    uint32_t sectorFromOffset(uint64_t offset) const
+    {
+        if constexpr (BlockSize != 0)
+        {
+            return static_cast<uint32_t>(offset >> kBlockShift);
+        }
+        return static_cast<uint32_t>(m_scsi_block_shift ? offset >> m_scsi_block_shift : offset / m_scsi_block_size);
+    }
+    uint32_t groupFromOffset(uint64_t offset) const
+    {
+        return m_group_offset_shift ? static_cast<uint32_t>(offset >> m_group_offset_shift) : sectorFromOffset(offset) / m_cow_group_size;
+    }
+    uint64_t offsetFromSector(uint32_t sector) const
+    {
+        if constexpr (BlockSize != 0)
+        {
+            return static_cast<uint64_t>(sector) << kBlockShift;
+        }
+        return static_cast<uint64_t>(sector) * m_scsi_block_size;
+    }
+    uint64_t offsetFromGroup(uint32_t group) const { return static_cast<uint64_t>(group) * m_cow_group_size_bytes; }
+    uint64_t groupEndOffset(uint32_t group) const { return std::min(offsetFromGroup(group + 1), m_image_size_bytes); } // Last group can be short
 
     // Helper methods
-    ssize_t performCopyOnWrite(uint32_t from_offset, uint32_t to_offset);
+    ssize_t performCopyOnWrite(uint64_t from_offset, uint64_t to_offset);
+    uint32_t copyChunkSize(uint64_t offset, uint64_t to_offset) const;
+    eImageType countPartialGroup(uint32_t group);
+    ssize_t writeWithCopyOnWrite(uint64_t head_start, uint64_t from, uint64_t to, uint64_t tail_end, const void *buf);
+    ssize_t writeStaged(uint64_t head_start, uint64_t from, uint64_t to, uint64_t tail_end, const void *buf);
     uint64_t position() const { return m_current_position; }
 
-    uint64_t m_current_position = 0; // Track current file position
+    CowRelaxed<uint64_t> m_current_position = 0; // Track current file position
 };
+
+// The store with the SCSI block size taken at run time
+using ImageBackingStore = BasicImageBackingStore<0>;
+
+// Built once in zulu_cow.cpp
+extern template class BasicImageBackingStore<0>;
+extern template class BasicImageBackingStore<512>;
+extern template class BasicImageBackingStore<2048>;